@@ -0,0 +1,12 @@
+#pragma once
+
+// Measures the card, the VS1053 and the display, so cards, clock settings
+// and builds can be compared on real hardware. Entered by holding the
+// encoder button at boot. Results are shown, and appended to BENCH.CSV in
+// the root of the card.
+
+// Run the benchmark if the button is held, and return once the results have
+// been dismissed with a press. Call after the card, VS1053, display and
+// encoder are set up and the SPI clocks calibrated, and before songs are
+// loaded.
+void benchmark_runIfRequested();
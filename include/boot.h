@@ -0,0 +1,13 @@
+#pragma once
+
+// Time spent in each step of setup(), for finding what holds up boot.
+
+// Mark the end of a boot stage. Each stage runs from the end of the one
+// before, or from reset for the first.
+void boot_stage(const char *name);
+
+// Note that the first song is reaching the decoder.
+void boot_firstAudio();
+
+// Print each stage's time, the total, and the time to first audio.
+void boot_report();
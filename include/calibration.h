@@ -0,0 +1,13 @@
+#pragma once
+
+// Finds the fastest SPI clocks the card and the VS1053 work at on this
+// board, by stepping up through the clocks the SPI peripheral makes and
+// checking reads and writes at each. The results are saved in the settings,
+// and stepped back down if errors show up later.
+
+// Apply the saved clocks, or find them if there aren't any. Call after the
+// card and VS1053 are set up and settings are loaded.
+void calibration_begin();
+
+// Step a clock down if it's seen errors. Call every frame.
+void calibration_loop();
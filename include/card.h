@@ -0,0 +1,76 @@
+#pragma once
+#include <extents.h>
+
+#include <SD.h>
+#include <stdint.h>
+#include <vector>
+
+// Raw access to the card alongside the SD library. Also used by mass storage.
+extern Sd2Card card;
+extern SdVolume volume;
+
+// Where a root directory file's entry is, so it can be opened again without
+// searching the directory by name.
+struct CardEntry {
+  char name[13];
+  uint16_t dir_index;
+  uint32_t first_cluster;
+  uint32_t size;
+};
+
+// Mount the volume. Call again after anything else has written to the card.
+bool card_setup();
+
+// Initialize the card at the clock set with card_setClock(), without
+// mounting. For mass storage, which mounts its own way.
+bool card_init(uint8_t cs_pin);
+
+// Run the card at this SPI clock, or at full speed if 0, from now and across
+// card_init(). Sd2Card keeps one clock for every instance, so the SD
+// library's reads run at it too.
+void card_setClock(uint32_t hz);
+
+// Block reads and writes that have failed since boot. Counted from the
+// interrupt as well, without locking, so only close.
+uint32_t card_errors();
+
+// Iterate files (not directories) in the root directory, from the given
+// directory entry.
+void card_rewind(uint16_t dir_index=0);
+bool card_nextFile(CardEntry *entry);
+
+// Search the root directory for a file by its short name.
+bool card_find(const char *name, CardEntry *entry);
+
+// Open a root directory file from its directory entry index. Returns a closed
+// File if the entry no longer describes the same file.
+File card_open(uint16_t dir_index, uint32_t first_cluster, const char *name);
+
+// Follow the FAT chain for a file of the given size, merging consecutive
+// clusters. Returns false if the chain is broken or needs more than
+// max_extents runs.
+bool card_extents(uint32_t first_cluster, uint32_t size, std::vector<CardExtent> *extents,
+                  size_t max_extents);
+
+// Card block where the given cluster starts.
+uint32_t card_clusterBlock(uint32_t cluster);
+uint8_t card_blocksPerCluster();
+
+bool card_readBlock(uint32_t block, uint8_t *dst);
+bool card_writeBlock(uint32_t block, const uint8_t *src);
+
+// Find, or create, a root directory file of the given size whose clusters
+// are all consecutive, and give the card block it starts at. Writing its
+// blocks with card_writeBlock() doesn't touch the FAT or directory. A new
+// file holds whatever was on the card before, so created says whether it
+// was just made.
+bool card_contiguousFile(const char *name, uint32_t size, uint32_t *first_block, bool *created);
+
+// Create a file of the given size in a directory off the root, replacing any
+// file of that name, with all its clusters allocated up front and
+// consecutive, and give the card block it starts at.
+bool card_createContiguous(const char *dir, const char *name, uint32_t size, uint32_t *first_block);
+
+// Rename a file in a directory off the root, replacing any file already
+// called to. The new name takes a single directory block write.
+bool card_rename(const char *dir, const char *from, const char *to);
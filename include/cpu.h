@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+
+// Core clock scaling. Steady playback needs little of the core, so it runs
+// slower to save power, and anything CPU- or card-bound (importing, mass
+// storage, the benchmark) runs at F_CPU.
+enum CpuSpeed {
+  // F_CPU divided down to about 50 MHz.
+  cpu_low,
+  cpu_full,
+  cpu_speed_count,
+};
+
+// Change the core clock. Only the core and SysTick slow down: SPI, I2C and
+// USB run from their own 48 MHz clock. millis() stays right, but the core's
+// micros() only counts the first 1/divider of each millisecond while slowed,
+// so use cpu_micros().
+void cpu_setSpeed(CpuSpeed speed);
+
+CpuSpeed cpu_speed();
+
+// micros() that's right at any speed. Safe to call from an interrupt.
+unsigned long cpu_micros();
+
+// delayMicroseconds() counts cycles at F_CPU, so it waits longer while
+// slowed. This doesn't.
+void cpu_delayMicroseconds(uint32_t us);
+
+// Log the time spent at each speed since the last report.
+void cpu_report();
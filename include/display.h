@@ -3,4 +3,9 @@ const char* const booting    = "Boot";
 const char* const boot_error = "Boot error";
 
 bool display_setup();
-bool display_text(const char* top, const char* bottom);
+// Show a progress bar under the bottom line when progress is from 0 to 1.
+bool display_text(const char* top, const char* bottom, float progress=-1);
+
+// Time sending the whole screen, and sending a single changed pixel, leaving
+// what's shown as it was.
+void display_timeFlush(unsigned long *full_us, unsigned long *partial_us);
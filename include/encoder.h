@@ -1,3 +1,4 @@
+#pragma once
 #include <stdbool.h>
 
 bool encoder_setup();
@@ -5,5 +6,27 @@ void encoder_loop();
 
 void encoder_led_off();
 
-bool encoder_togglePause();
-int encoder_getChange();
+// Presses are reported on release, by how long the button was held. Turning
+// while it's held uses the press for that instead, so releasing it reports
+// nothing.
+enum EncoderPress {
+  press_none,
+  press_short,
+  press_long,
+};
+
+EncoderPress encoder_getPress();
+
+// Whether the button is down, as of the last encoder_getPress().
+bool encoder_held();
+
+// Whether the button is down right now, without debouncing. For checking at
+// boot.
+bool encoder_buttonDown();
+
+// Red when paused, and off otherwise.
+void encoder_showPaused(bool paused);
+
+// Detents turned since the last call. When accelerated, fast turns are scaled
+// up to cover more distance.
+int encoder_getChange(bool accelerated=false);
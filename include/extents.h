@@ -0,0 +1,41 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Cluster extent maps, kept apart from the SD library so they can be tested
+// on the host against a fake card.
+
+// A run of consecutive clusters.
+struct CardExtent {
+  uint32_t first_cluster;
+  uint32_t cluster_count;
+};
+
+// Where a FAT16 or FAT32 volume keeps its first FAT, and how big it is.
+struct FatGeometry {
+  uint8_t fat_type;
+  uint8_t blocks_per_cluster;
+  uint32_t cluster_count;
+  uint32_t fat_start_block;
+};
+
+typedef bool (*BlockReader)(uint32_t block, uint8_t *dst);
+
+// Follow the FAT chain for a file of the given size, merging consecutive
+// clusters. Returns false if the chain is broken or needs more than
+// max_extents runs.
+bool extents_build(const FatGeometry &geometry, BlockReader read_block, uint32_t first_cluster,
+                   uint32_t size, std::vector<CardExtent> *extents, size_t max_extents);
+
+// Extent containing the last block looked up, so sequential lookups don't
+// rescan the map.
+struct ExtentCursor {
+  size_t index;
+  uint32_t start_block;
+};
+
+// Find a block of the file: the first cluster of the extent holding it, and
+// how many blocks into the extent it is. Returns false past the end.
+bool extents_locate(const std::vector<CardExtent> &extents, uint8_t blocks_per_cluster, uint32_t file_block,
+                    ExtentCursor *cursor, uint32_t *first_cluster, uint32_t *block_offset);
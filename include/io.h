@@ -0,0 +1,33 @@
+#pragma once
+#include <stdint.h>
+
+// Orders card access from loop() so audio comes first. Everything else that
+// uses the card brackets each piece of work with io_begin() and io_end(),
+// which tops up the stream's read-ahead before the work starts, and counts
+// the time each class spends against its budget. The SD library is only used
+// from loop(); the DREQ interrupt reads nothing but raw blocks of a mapped
+// track, so no class has to wait for the one playing.
+enum IoClass {
+  // Read-ahead for the playing track.
+  io_audio,
+  // Reads the listener is waiting on: opening songs, searching, settings.
+  io_interactive,
+  // Work nobody is waiting on: importing, caching, the journal.
+  io_background,
+  io_class_count,
+};
+
+// Read ahead for the playing track. Call every frame.
+void io_poll();
+
+// Whether the class has budget left this second. Work that can wait for a
+// later frame should check before starting.
+bool io_available(IoClass io_class);
+
+// Start a piece of card work, reading ahead for audio first.
+void io_begin(IoClass io_class);
+
+void io_end(IoClass io_class);
+
+// Log each class's work, time and waiting since the last report.
+void io_report();
@@ -0,0 +1,26 @@
+#pragma once
+#include <stdint.h>
+
+// Playback position kept on the card so it survives a reset or power cycle.
+// Records go round a ring of card blocks in a preallocated file, one block
+// per record, so writing one is a single block write with no FAT or
+// directory update, and repeated writes are spread over the ring.
+
+struct JournalRecord {
+  // Song index in the library, and its filename in case the index moved.
+  uint16_t song_index;
+  char filename[13];
+  // Active playlist, or -1 for the whole library.
+  int16_t playlist;
+  uint32_t offset;
+  uint16_t seconds;
+};
+
+// Find or create the journal, and find its newest record. Call again after
+// anything else has written to the card.
+bool journal_begin();
+
+// The newest record. Returns false if there isn't one.
+bool journal_read(JournalRecord *record);
+
+bool journal_write(const JournalRecord &record);
@@ -0,0 +1,40 @@
+#pragma once
+#include <stdint.h>
+
+// Timestamps a song change from the encoder turn that caused it to the
+// decoder producing audio, and keeps recent times for each stage in between.
+// Each stage is only recorded after the one before it, so turns that don't
+// change songs (seeking, searching) never complete a trace.
+enum LatencyStage {
+  // The encoder position is about to be read over I2C.
+  latency_poll,
+  // The read showed the encoder moved.
+  latency_input,
+  // The turn moved the selection.
+  latency_selected,
+  // The selection settled and the switch began.
+  latency_settled,
+  // The previous song was cancelled.
+  latency_stopped,
+  // The new song is open and positioned, and about to be fed.
+  latency_started,
+  // The first chunk of the new song reached the decoder.
+  latency_fed,
+  // The decoder reported the new song's format. Checked once a frame.
+  latency_decoding,
+  latency_stage_count,
+};
+
+// Start a trace at the given micros() time, replacing any trace unfinished.
+void latency_begin(unsigned long poll_start_us);
+
+// Record the time for a stage of the trace in progress. Safe to call from an
+// interrupt.
+void latency_mark(LatencyStage stage);
+
+// Whether the trace in progress is waiting on this stage.
+bool latency_waiting(LatencyStage stage);
+
+// Log the time taken by each stage over recent song changes, if there were
+// any since the last report.
+void latency_report();
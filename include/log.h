@@ -0,0 +1,37 @@
+#pragma once
+#include <stdint.h>
+
+// Logging that never waits on the serial port. Messages go into a RAM ring
+// buffer, which loop() drains into the USB serial buffer in frame time left
+// over. Messages that don't fit are counted and dropped.
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_ERROR 3
+
+// Messages below this level are compiled out. Set with -DLOG_LEVEL=...
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+void log_printf(const char *format, ...) __attribute__((format(printf, 1, 2)));
+
+// A compact record for hot paths: only the format pointer and two numbers
+// are stored, and formatting waits until it's drained. format must be a
+// string literal taking two unsigned long arguments (or fewer).
+void log_event(const char *format, uint32_t a = 0, uint32_t b = 0);
+
+// Write as much as the serial port takes without blocking.
+void log_drain();
+
+// Messages dropped because the ring buffer was full.
+uint32_t log_dropped();
+
+#define LOG_AT(level, ...) do { if ((level) >= LOG_LEVEL) log_printf(__VA_ARGS__); } while (0)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#define LOG_EVENT(level, ...) do { if ((level) >= LOG_LEVEL) log_event(__VA_ARGS__); } while (0)
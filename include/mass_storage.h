@@ -2,4 +2,10 @@
 
 void mass_storage_setup();
 bool mass_storage_button();
-void mass_storage_mode();
+
+// Offer the card over USB until the button is pressed again.
+// Returns whether the host wrote to the card.
+bool mass_storage_mode();
+
+// Reset the board; the fallback if the card can't be handed back to the player.
+void mass_storage_reset();
@@ -0,0 +1,33 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// MPEG audio stream layout, from the first frame header and any Xing/Info or
+// VBRI header in it, for mapping times to byte offsets without reading the
+// rest of the file.
+struct Mp3Info {
+  // Offset of the first frame, and bytes from there to the end of the file.
+  uint32_t audio_start;
+  uint32_t audio_bytes;
+  uint32_t duration_ms;
+  // Byte position at each percent of the duration, in 256ths of
+  // audio_bytes. Without one, the bitrate is taken to be constant.
+  bool has_toc;
+  uint8_t toc[100];
+};
+
+// Length of an ID3v2 tag at the start of the data, or 0 if there isn't one.
+uint32_t mp3_id3Length(const uint8_t *data, size_t length);
+
+// Length in milliseconds from the TLEN frame of an ID3v2 tag at the start of
+// the data, or 0 if it isn't there. Only frames within the data are checked.
+uint32_t mp3_tagLength(const uint8_t *data, size_t length);
+
+// Parse the start of the audio, found at data_offset in a file of file_size
+// bytes. Skips anything before the first frame header. Returns false if
+// there's no frame header.
+bool mp3_parse(const uint8_t *data, size_t length, uint32_t data_offset, uint32_t file_size,
+               Mp3Info *info);
+
+// Byte offset in the file to start from to play from the given time.
+uint32_t mp3_offset(const Mp3Info &info, uint32_t seconds);
@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+// M3U playlists from the root of the card, compiled at import time into song
+// indices in the library so playing one never reads the text again.
+
+// Parse every playlist against the loaded library and write the compiled
+// playlists to the cache. Entries that don't match a song are reported and
+// left out.
+void playlist_import();
+
+// The same, a playlist at a time. Returns false once there are none left and
+// the cache is written.
+void playlist_beginImport();
+bool playlist_importNext();
+
+// Read compiled playlists from the cache. Returns false if it's missing or
+// was built for a different library.
+bool playlist_loadCache();
+
+int playlist_count();
+const char *playlist_name(int playlist);
+const std::vector<uint16_t> &playlist_songs(int playlist);
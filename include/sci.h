@@ -0,0 +1,53 @@
+#pragma once
+#include <stdint.h>
+
+// VS1053 register (SCI) access at the fastest clock the chip allows for its
+// current clock multiplier, or a slower calibrated one, with runs of writes batched
+// in one SPI transaction. The library's own access is fixed at 250 kHz.
+// Audio data (SDI) goes at the write clock too, rather than the library's
+// 8 MHz.
+
+// Call after the VS1053 is reset, and again if SCI_CLOCKF changes. Forgets
+// the shadowed register values.
+void sci_begin(uint8_t cs_pin, uint8_t dcs_pin, uint8_t dreq_pin);
+
+// The datasheet's limits for the current clock multiplier: CLKI/7 for
+// reads, and CLKI/4 for writes and SDI.
+void sci_limits(uint32_t *read_hz, uint32_t *write_hz);
+
+// Use these clocks in place of the datasheet's, from now and across
+// sci_begin(), as long as they're within its limits. 0 keeps the
+// datasheet's.
+void sci_setClocks(uint32_t read_hz, uint32_t write_hz);
+
+// Whether words written at write_hz read back at the slowest clock, and
+// the other way around for read_hz. Uses scratch X memory, restored after.
+bool sci_testClocks(uint32_t read_hz, uint32_t write_hz);
+
+void sci_write(uint8_t address, uint16_t value);
+uint16_t sci_read(uint8_t address);
+
+// Whether a register reads back as it was last written. True if it hasn't
+// been written since sci_begin(). Not for registers the chip changes.
+bool sci_check(uint8_t address);
+
+// Send audio data. DREQ must be high, and length at most 32 bytes.
+void sci_writeData(const uint8_t *data, uint8_t length);
+
+// Write a register only if it was last written with a different value, such
+// as SCI_VOL or SCI_BASS. Not for registers the chip changes by itself.
+void sci_set(uint8_t address, uint16_t value);
+
+// Seconds decoded, read from the chip every few seconds and counted on the
+// local clock in between while running.
+uint16_t sci_decodeTime(bool running);
+// Set the decode time. The datasheet says to write it twice.
+void sci_setDecodeTime(uint16_t seconds);
+
+// SCI transactions per second since the last call.
+uint16_t sci_transactionsPerSecond();
+
+// Load a plugin in VLSI's compressed format. Instruction memory survives a
+// soft reset, so if a stamp on the chip says this plugin was loaded in full,
+// its large instruction runs are skipped. Returns whether anything was.
+bool sci_loadPlugin(const uint16_t *plugin, uint16_t size);
@@ -0,0 +1,30 @@
+#pragma once
+#include <stdint.h>
+#include <vector>
+
+// Substring search over song display names, backed by a trigram index on the
+// card. Matching ignores case and punctuation.
+
+// Build the index if it's missing or doesn't match the loaded songs.
+void search_prepareIndex();
+
+// The same, a step at a time: each search_buildIndex() looks at one song.
+// Returns false once the index is ready, or the build failed.
+void search_beginIndex();
+bool search_buildIndex();
+
+// Stop a build partway, leaving an index that reads as invalid, so the card
+// can be handed over.
+void search_abortIndex();
+
+// Find songs containing the query. Queries shorter than search_min_query
+// match nothing. When the query extends the previous one, only the previous
+// results are checked; otherwise candidates come from the index.
+const size_t search_min_query = 3;
+void search_query(const char *query);
+
+// Song indices of the results of the last query, in library order.
+const std::vector<uint16_t> &search_results();
+
+// Release the results.
+void search_end();
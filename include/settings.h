@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+// Preferences kept on the card across reboots. Unlike the song cache, these
+// aren't rebuilt, so mass storage leaves them alone.
+struct Settings {
+  bool shuffle;
+  // Picks the shuffle order; a new seed is chosen each time shuffle is
+  // turned on.
+  uint32_t shuffle_seed;
+  // Fastest SPI clocks found to work on this board, or 0 until calibrated.
+  uint32_t card_spi_hz;
+  uint32_t sci_read_hz;
+  uint32_t sci_write_hz;
+};
+
+extern Settings settings;
+
+// Read settings from the card, keeping defaults for anything missing.
+bool settings_load();
+
+bool settings_save();
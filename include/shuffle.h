@@ -0,0 +1,10 @@
+#pragma once
+#include <stdint.h>
+
+// A shuffled order of count songs without storing it: position i in the
+// shuffle plays song shuffle_song(i). Each seed gives a different order, and
+// the same seed always gives the same one.
+uint16_t shuffle_song(uint16_t position, uint16_t count, uint32_t seed);
+
+// Where a song is in the shuffled order; the inverse of shuffle_song().
+uint16_t shuffle_position(uint16_t song, uint16_t count, uint32_t seed);
@@ -0,0 +1,58 @@
+#pragma once
+#include <Adafruit_VS1053.h>
+#include <stdint.h>
+
+// Feeds the VS1053 from its DREQ interrupt. Track data is read straight from
+// card data blocks using a cluster extent map built when the track is
+// prepared, so playback never has to walk the FAT. A track that can't be
+// mapped is only read from loop(), since the SD library isn't safe to use
+// from the interrupt.
+
+// Take over feeding from the DREQ interrupt. Returns false if the pin can't
+// interrupt.
+bool stream_begin(Adafruit_VS1053 *player, uint8_t dreq_pin);
+
+// Open and map a root directory file. One track is kept prepared alongside
+// the one playing, so preparing the next song ahead of time makes starting it
+// cheap. Preparing the track that's already prepared does nothing.
+bool stream_prepare(const char *filename, uint16_t dir_index, uint32_t first_cluster);
+
+// Whether the prepared track reads straight from card blocks. One that
+// doesn't plays only from what stream_refill() reads ahead, so it stalls
+// while loop() is held up.
+bool stream_preparedMapped();
+
+// Start the prepared track at the given byte offset, or after any ID3v2 tag
+// if it's 0, with the decode time set to seconds.
+bool stream_start(uint32_t offset, uint16_t seconds);
+
+// Stop feeding and cancel decoding, leaving the decoder ready for the next
+// track. The prepared track is kept. Returns false if the decoder didn't
+// finish cancelling, in which case it needs a soft reset.
+bool stream_stop();
+
+// Stop, and close every file so something else can have the card.
+void stream_close();
+
+// Jump to a time in an MP3 track, using its Xing or VBRI seek table if it
+// has one, or its bitrate if not. Returns false if the track can't seek.
+bool stream_seek(uint16_t seconds);
+
+// Length of the playing track in seconds, or 0 if it isn't known.
+uint16_t stream_duration();
+
+void stream_pause(bool pause);
+
+// Whether the track is still playing (or paused) rather than finished.
+bool stream_playing();
+
+// Byte offset in the playing track of the next data to send.
+uint32_t stream_position();
+
+// Read ahead of the playing track into a ring of blocks the interrupt sends
+// from, then top up the decoder. Returns the number of blocks read.
+uint8_t stream_refill();
+
+// The fewest blocks the ring held, and the reads the interrupt made itself
+// because it was empty, since the last call.
+void stream_bufferStats(uint8_t *lowest_blocks, uint32_t *interrupt_reads);
@@ -0,0 +1,5 @@
+#pragma once
+
+// Handle encoder input according to the current mode, run the player, and
+// draw the display. Returns whether the display was updated.
+bool ui_loop();
@@ -2,15 +2,81 @@
 #include <led.h>
 
 bool vs1053_setup();
+
+// Load the library from the cache, or if there isn't one, start importing it
+// from loop() with vs1053_import().
 void vs1053_loadSongs();
+
+// Import songs for about the given time, if the library is being imported.
+// At least one song is imported per call, so it always makes progress.
+// Playback starts with the first song found, and the song list grows as songs
+// are found, in card order until they're all in.
+void vs1053_import(unsigned long budget_us);
+bool vs1053_importing();
 void vs1053_clearSongCache();
 
+// Volume, song changes, and advancing at the end of a song.
+void vs1053_loop();
+
+// Show the selected song, with status in place of the play time if given.
 // Returns whether the display was updated.
-bool vs1053_loop();
+bool vs1053_display(const char *status=NULL);
 
 bool vs1053_changeSong(int direction);
+
+// Move forwards or backwards within the playing song by the given number of
+// seconds. Only MP3s can seek.
+bool vs1053_seek(int seconds);
+
+// Start playback where it was before the last reset or power cycle, or from
+// the first song.
+bool vs1053_start();
+
+// Move the selection right away, but only start the song once the selection
+// stops changing.
+void vs1053_browse(int direction);
+
+// Start the song at the given index in the library right away.
+bool vs1053_play(int index);
+
+int vs1053_songCount();
+const char *vs1053_songName(int index);
+
+// Index in the library of the song with the given filename, or -1.
+int vs1053_findSong(const char *filename);
+
+// Play songs from a playlist, or the whole library if playlist is -1,
+// starting from its first song.
+bool vs1053_selectPlaylist(int playlist);
+int vs1053_playlist();
+
+// Browse by the first character of the filename, a group at a time.
+void vs1053_jump(int direction);
+// First character of the selected song's group.
+char vs1053_jumpGroup();
 void vs1053_pause(bool pause);
 
+// Play songs in a shuffled order rather than library order. The setting and
+// the order are saved.
+void vs1053_setShuffle(bool shuffle);
+bool vs1053_shuffle();
+
+// Stop playback and release the card, remembering the position.
+void vs1053_suspend();
+
+// Take the card back after mass storage, reload the song list if the card
+// was modified, and continue playback where vs1053_suspend() left off.
+// Returns false if the card couldn't be reinitialized.
+bool vs1053_resume(bool card_modified);
+
+// Time sending the given number of bytes of silence to the decoder.
+unsigned long vs1053_timeDataWrite(uint32_t bytes);
+
+// Time importing every song's tags, writing the cache, and then loading it.
+// Leaves the song list empty; vs1053_loadSongs() loads it after.
+void vs1053_timeLibrary(unsigned long *import_us, unsigned long *cache_write_us,
+                        unsigned long *cache_load_us, int *song_count);
+
 // Beep for the given duration at a default of 375 Hz
 void vs1053_beep(uint16_t duration_ms, uint8_t frequency_code=0x42);
 
@@ -0,0 +1,169 @@
+#include <benchmark.h>
+
+#include <card.h>
+#include <cpu.h>
+#include <display.h>
+#include <encoder.h>
+#include <sci.h>
+#include <settings.h>
+#include <vs1053.h>
+
+#include <Adafruit_VS1053.h>
+#include <Arduino.h>
+#include <SD.h>
+
+const char *const results_filename = "BENCH.CSV";
+const char *const benchmark_status = "Benchmark";
+
+// 1 MiB, from the start of the data area.
+const uint32_t sequential_blocks = 2048;
+const uint16_t random_blocks = 256;
+const uint32_t data_write_bytes = 65536;
+const uint16_t sci_repeats = 1000;
+
+struct Results {
+  uint32_t card_mb;
+  // Calibrated clocks, or 0 for the defaults.
+  uint32_t card_spi_khz;
+  uint32_t sci_write_khz;
+  float sequential_kbps;
+  float random_reads_per_s;
+  float data_write_kbps;
+  float sci_read_us;
+  float sci_write_us;
+  unsigned long display_full_us;
+  unsigned long display_partial_us;
+  int song_count;
+  float import_songs_per_s;
+  float cache_songs_per_s;
+  unsigned long cache_write_ms;
+};
+
+float kilobytesPerSecond(uint32_t bytes, unsigned long elapsed_us)
+{
+  return bytes * 1000000.0f / 1024 / max(elapsed_us, 1ul);
+}
+
+float perSecond(uint32_t count, unsigned long elapsed_us)
+{
+  return count * 1000000.0f / max(elapsed_us, 1ul);
+}
+
+void measureCard(Results *results)
+{
+  uint8_t block[512];
+
+  display_text("SD sequential read", benchmark_status);
+  uint32_t first_block = card_clusterBlock(2);
+  unsigned long start = cpu_micros();
+  for (uint32_t i = 0; i < sequential_blocks; i++)
+    card_readBlock(first_block + i, block);
+  results->sequential_kbps = kilobytesPerSecond(sequential_blocks * sizeof(block), cpu_micros() - start);
+
+  display_text("SD random read", benchmark_status);
+  uint32_t card_blocks = card.cardSize();
+  results->card_mb = card_blocks / 2048;
+  randomSeed(cpu_micros());
+  start = cpu_micros();
+  for (uint16_t i = 0; i < random_blocks; i++)
+    card_readBlock(random(card_blocks), block);
+  results->random_reads_per_s = perSecond(random_blocks, cpu_micros() - start);
+}
+
+void measureVs1053(Results *results)
+{
+  display_text("VS1053 data write", benchmark_status);
+  results->data_write_kbps = kilobytesPerSecond(data_write_bytes, vs1053_timeDataWrite(data_write_bytes));
+
+  display_text("VS1053 register access", benchmark_status);
+  unsigned long start = cpu_micros();
+  for (uint16_t i = 0; i < sci_repeats; i++)
+    sci_read(VS1053_REG_STATUS);
+  results->sci_read_us = (float) (cpu_micros() - start) / sci_repeats;
+
+  // WRAMADDR only matters to the next WRAM access.
+  start = cpu_micros();
+  for (uint16_t i = 0; i < sci_repeats; i++)
+    sci_write(VS1053_REG_WRAMADDR, 0);
+  results->sci_write_us = (float) (cpu_micros() - start) / sci_repeats;
+}
+
+void measureLibrary(Results *results)
+{
+  unsigned long import_us;
+  unsigned long cache_write_us;
+  unsigned long cache_load_us;
+  vs1053_timeLibrary(&import_us, &cache_write_us, &cache_load_us, &results->song_count);
+
+  results->cache_write_ms = cache_write_us / 1000;
+  results->import_songs_per_s = perSecond(results->song_count, import_us);
+  results->cache_songs_per_s = perSecond(results->song_count, cache_load_us);
+}
+
+void saveResults(const Results &results)
+{
+  auto file = SD.open(results_filename, FILE_WRITE);
+  if (!file) {
+    Serial.printf("Failed to open %s\r\n", results_filename);
+    return;
+  }
+
+  if (!file.size()) {
+    file.print("build,card_mb,card_spi_khz,sci_write_khz,sequential_kbps,random_reads_per_s,data_write_kbps,"
+               "sci_read_us,sci_write_us,display_full_us,display_partial_us,songs,import_songs_per_s,cache_songs_per_s,cache_write_ms\r\n");
+  }
+
+  char line[256];
+  snprintf(line, sizeof(line), "%s %s,%lu,%lu,%lu,%.1f,%.1f,%.1f,%.2f,%.2f,%lu,%lu,%d,%.1f,%.1f,%lu\r\n",
+           __DATE__, __TIME__, results.card_mb, results.card_spi_khz, results.sci_write_khz,
+           results.sequential_kbps, results.random_reads_per_s, results.data_write_kbps,
+           results.sci_read_us, results.sci_write_us, results.display_full_us, results.display_partial_us,
+           results.song_count, results.import_songs_per_s, results.cache_songs_per_s, results.cache_write_ms);
+  file.print(line);
+  file.close();
+
+  Serial.print(line);
+}
+
+void benchmark_runIfRequested()
+{
+  if (!encoder_buttonDown())
+    return;
+
+  // Start with the button up, so letting go isn't taken as a press after.
+  display_text("Release to start", benchmark_status);
+  while (encoder_buttonDown())
+    delay(10);
+
+  // Measure at the speed imports and mass storage run at.
+  cpu_setSpeed(cpu_full);
+
+  Results results = {};
+  results.card_spi_khz = settings.card_spi_hz / 1000;
+  results.sci_write_khz = settings.sci_write_hz / 1000;
+
+  measureCard(&results);
+  measureVs1053(&results);
+
+  display_text("Display flush", benchmark_status);
+  display_timeFlush(&results.display_full_us, &results.display_partial_us);
+
+  measureLibrary(&results);
+
+  saveResults(results);
+
+  char summary[256];
+  snprintf(summary, sizeof(summary),
+           "SD %.0f KB/s, %.0f reads/s | SDI %.0f KB/s | SCI r %.1f w %.1f us | "
+           "OLED %lu/%lu us | import %.1f/s, cache %.0f/s, written in %lu ms",
+           results.sequential_kbps, results.random_reads_per_s, results.data_write_kbps,
+           results.sci_read_us, results.sci_write_us, results.display_full_us,
+           results.display_partial_us, results.import_songs_per_s, results.cache_songs_per_s,
+           results.cache_write_ms);
+
+  // Scroll the results until they're dismissed.
+  while (encoder_getPress() != press_short) {
+    display_text(summary, "Press to play");
+    delay(70);
+  }
+}
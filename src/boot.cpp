@@ -0,0 +1,42 @@
+#include <boot.h>
+
+#include <cpu.h>
+
+#include <Arduino.h>
+
+const uint8_t max_stages = 16;
+
+struct BootStage {
+  const char *name;
+  unsigned long end_us;
+};
+
+BootStage stages[max_stages];
+uint8_t stage_count;
+unsigned long first_audio_us;
+
+void boot_stage(const char *name)
+{
+  if (stage_count < max_stages)
+    stages[stage_count++] = BootStage{name, cpu_micros()};
+}
+
+void boot_firstAudio()
+{
+  if (!first_audio_us)
+    first_audio_us = cpu_micros();
+}
+
+void boot_report()
+{
+  unsigned long start = 0;
+  for (uint8_t i = 0; i < stage_count; i++) {
+    Serial.printf("Boot %-16s %6lu ms\r\n", stages[i].name, (stages[i].end_us - start) / 1000);
+    start = stages[i].end_us;
+  }
+
+  Serial.printf("Boot completed in %lu ms", start / 1000);
+  if (first_audio_us)
+    Serial.printf(", first audio at %lu ms", first_audio_us / 1000);
+  Serial.print("\r\n");
+}
@@ -0,0 +1,202 @@
+#include <calibration.h>
+
+#include <card.h>
+#include <constants.h>
+#include <io.h>
+#include <log.h>
+#include <sci.h>
+#include <settings.h>
+
+#include <Adafruit_VS1053.h>
+#include <Arduino.h>
+
+// Clocks the SPI peripheral divides evenly from its 48 MHz reference,
+// slowest first.
+const uint32_t steps_hz[] = {4000000, 6000000, 8000000, 12000000, 24000000};
+
+// Card blocks compared at each step, spread over the start of the data area.
+const uint8_t sample_blocks = 16;
+const uint32_t sample_stride = 64;
+const uint8_t card_passes = 4;
+
+// How often a VS1053 register is read back while playing.
+const unsigned long sci_check_interval_ms = 5000;
+
+uint32_t seen_card_errors;
+unsigned long last_sci_check;
+
+uint32_t blockHash(const uint8_t *data)
+{
+  uint32_t hash = 2166136261u;
+  for (uint16_t i = 0; i < 512; i++)
+    hash = (hash ^ data[i]) * 16777619u;
+  return hash;
+}
+
+uint32_t sampleBlock(uint8_t i)
+{
+  return card_clusterBlock(2) + i * sample_stride;
+}
+
+bool cardReadsAt(uint32_t hz, const uint32_t *expected)
+{
+  uint8_t block[512];
+
+  card_setClock(hz);
+  for (uint8_t pass = 0; pass < card_passes; pass++) {
+    for (uint8_t i = 0; i < sample_blocks; i++) {
+      if (!card_readBlock(sampleBlock(i), block) || blockHash(block) != expected[i])
+        return false;
+    }
+  }
+
+  return true;
+}
+
+// Sd2Card doesn't turn on the card's CRC checks, so reads at each clock are
+// compared with the same blocks read at the slowest.
+uint32_t calibrateCard()
+{
+  uint8_t block[512];
+  uint32_t expected[sample_blocks];
+
+  card_setClock(steps_hz[0]);
+  for (uint8_t i = 0; i < sample_blocks; i++) {
+    if (!card_readBlock(sampleBlock(i), block))
+      return 0;
+    expected[i] = blockHash(block);
+  }
+
+  uint32_t fastest = steps_hz[0];
+  for (uint8_t step = 1; step < COUNT_OF(steps_hz); step++) {
+    if (!cardReadsAt(steps_hz[step], expected))
+      break;
+    fastest = steps_hz[step];
+  }
+
+  // A failed read can leave the card mid-command.
+  card_setClock(fastest);
+  card_setup();
+
+  return fastest;
+}
+
+// Reads and writes have different limits, so they're found separately, each
+// checked against the other at the slowest clock. Steps stop at the
+// datasheet's limits: passing a few read-backs doesn't make a clock past
+// them safe.
+void calibrateVs1053(uint32_t *read_hz, uint32_t *write_hz)
+{
+  uint32_t max_read_hz;
+  uint32_t max_write_hz;
+  sci_limits(&max_read_hz, &max_write_hz);
+
+  *read_hz = 0;
+  *write_hz = 0;
+
+  for (uint8_t step = 0; step < COUNT_OF(steps_hz); step++) {
+    uint32_t hz = min(steps_hz[step], max_read_hz);
+    if (!sci_testClocks(hz, min(steps_hz[0], max_write_hz)))
+      break;
+    *read_hz = hz;
+    if (hz == max_read_hz)
+      break;
+  }
+
+  for (uint8_t step = 0; step < COUNT_OF(steps_hz); step++) {
+    uint32_t hz = min(steps_hz[step], max_write_hz);
+    if (!sci_testClocks(min(steps_hz[0], max_read_hz), hz))
+      break;
+    *write_hz = hz;
+    if (hz == max_write_hz)
+      break;
+  }
+}
+
+void calibration_begin()
+{
+  bool changed = false;
+
+  if (!settings.card_spi_hz) {
+    unsigned long start = millis();
+    settings.card_spi_hz = calibrateCard();
+    changed = settings.card_spi_hz;
+    Serial.printf("Card SPI calibrated to %lu kHz in %lu ms\r\n", settings.card_spi_hz / 1000, millis() - start);
+  }
+
+  // Also redo clocks saved past the limits, by builds that didn't keep to
+  // them.
+  uint32_t max_read_hz;
+  uint32_t max_write_hz;
+  sci_limits(&max_read_hz, &max_write_hz);
+  if (!settings.sci_read_hz || !settings.sci_write_hz || settings.sci_read_hz > max_read_hz ||
+      settings.sci_write_hz > max_write_hz) {
+    unsigned long start = millis();
+    calibrateVs1053(&settings.sci_read_hz, &settings.sci_write_hz);
+    changed = changed || (settings.sci_read_hz && settings.sci_write_hz);
+    Serial.printf("VS1053 SPI calibrated to %lu kHz reads, %lu kHz writes in %lu ms\r\n",
+                  settings.sci_read_hz / 1000, settings.sci_write_hz / 1000, millis() - start);
+  }
+
+  if (changed)
+    settings_save();
+
+  card_setClock(settings.card_spi_hz);
+  sci_setClocks(settings.sci_read_hz, settings.sci_write_hz);
+
+  seen_card_errors = card_errors();
+}
+
+// Move a clock to the next step down, from a step or a datasheet limit
+// between steps. Returns false if it's already at the bottom.
+bool stepDown(uint32_t *hz)
+{
+  for (int8_t step = COUNT_OF(steps_hz) - 1; step >= 0; step--) {
+    if (steps_hz[step] < *hz) {
+      *hz = steps_hz[step];
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void calibration_loop()
+{
+  bool changed = false;
+
+  uint32_t errors = card_errors();
+  if (errors != seen_card_errors) {
+    seen_card_errors = errors;
+
+    if (stepDown(&settings.card_spi_hz)) {
+      card_setClock(settings.card_spi_hz);
+      LOG_WARN("Card errors; SPI down to %lu kHz\r\n", settings.card_spi_hz / 1000);
+      changed = true;
+    }
+  }
+
+  unsigned long now = millis();
+  if (now - last_sci_check >= sci_check_interval_ms) {
+    last_sci_check = now;
+
+    // Volume is only ever written by us, so it should read back. Either
+    // clock could be at fault.
+    if (!sci_check(VS1053_REG_VOLUME)) {
+      bool read_down = stepDown(&settings.sci_read_hz);
+      bool write_down = stepDown(&settings.sci_write_hz);
+      if (read_down || write_down) {
+        sci_setClocks(settings.sci_read_hz, settings.sci_write_hz);
+        LOG_WARN("VS1053 read-back failed; SPI down to %lu kHz reads, %lu kHz writes\r\n",
+                 settings.sci_read_hz / 1000, settings.sci_write_hz / 1000);
+        changed = true;
+      }
+    }
+  }
+
+  if (changed) {
+    io_begin(io_interactive);
+    settings_save();
+    io_end(io_interactive);
+  }
+}
@@ -0,0 +1,299 @@
+#include <card.h>
+
+#include <vs1053.h>
+
+#include <SD.h>
+
+// The SD library keeps its volume private, so mount a second one on the same
+// card. SdVolume's block cache is shared between instances, so the two stay
+// coherent.
+Sd2Card card;
+SdVolume volume;
+SdFile root;
+
+uint32_t clock_hz;
+volatile uint32_t errors;
+
+bool card_init(uint8_t cs_pin)
+{
+  if (!card.init(SPI_FULL_SPEED, cs_pin))
+    return false;
+
+  return !clock_hz || card.setSpiClock(clock_hz);
+}
+
+void card_setClock(uint32_t hz)
+{
+  clock_hz = hz;
+
+  // The interrupt reads the card too.
+  noInterrupts();
+  if (hz)
+    card.setSpiClock(hz);
+  else
+    card.setSckRate(SPI_FULL_SPEED);
+  interrupts();
+}
+
+uint32_t card_errors()
+{
+  return errors;
+}
+
+bool card_setup()
+{
+  root.close();
+
+  if (!card_init(CARDCS)) {
+    Serial.println("Card initialization failed");
+    return false;
+  }
+
+  if (!volume.init(card)) {
+    Serial.println("Could not find FAT16/FAT32 partition");
+    return false;
+  }
+
+  if (!root.openRoot(&volume)) {
+    Serial.println("Could not open root directory");
+    return false;
+  }
+
+  return true;
+}
+
+void card_rewind(uint16_t dir_index)
+{
+  root.seekSet((uint32_t) dir_index * sizeof(dir_t));
+}
+
+bool card_nextFile(CardEntry *entry)
+{
+  dir_t dir;
+
+  while (root.readDir(&dir) > 0) {
+    if (!DIR_IS_FILE(&dir))
+      continue;
+
+    // readDir() leaves the position just past the entry it returned.
+    entry->dir_index = root.curPosition() / sizeof(dir_t) - 1;
+    entry->first_cluster = (uint32_t) dir.firstClusterHigh << 16 | dir.firstClusterLow;
+    entry->size = dir.fileSize;
+    SdFile::dirName(dir, entry->name);
+
+    return true;
+  }
+
+  return false;
+}
+
+bool card_find(const char *name, CardEntry *entry)
+{
+  card_rewind();
+  while (card_nextFile(entry)) {
+    if (!strcmp(entry->name, name))
+      return true;
+  }
+
+  return false;
+}
+
+File card_open(uint16_t dir_index, uint32_t first_cluster, const char *name)
+{
+  SdFile file;
+  if (!file.open(&root, dir_index, O_READ))
+    return File();
+
+  // The card may have been modified since the entry was recorded.
+  dir_t dir;
+  char entry_name[13];
+  if (!file.dirEntry(&dir)) {
+    file.close();
+    return File();
+  }
+
+  SdFile::dirName(dir, entry_name);
+  if (strcmp(entry_name, name) || file.firstCluster() != first_cluster) {
+    file.close();
+    return File();
+  }
+
+  return File(file, entry_name);
+}
+
+bool readFatBlock(uint32_t block, uint8_t *dst)
+{
+  return card.readBlock(block, dst);
+}
+
+bool card_extents(uint32_t first_cluster, uint32_t size, std::vector<CardExtent> *extents,
+                  size_t max_extents)
+{
+  FatGeometry geometry = {
+    .fat_type = volume.fatType(),
+    .blocks_per_cluster = volume.blocksPerCluster(),
+    .cluster_count = volume.clusterCount(),
+    .fat_start_block = volume.fatStartBlock(),
+  };
+
+  return extents_build(geometry, readFatBlock, first_cluster, size, extents, max_extents);
+}
+
+uint32_t card_clusterBlock(uint32_t cluster)
+{
+  return volume.dataStartBlock() + ((cluster - 2) << volume.clusterSizeShift());
+}
+
+uint8_t card_blocksPerCluster()
+{
+  return volume.blocksPerCluster();
+}
+
+bool card_readBlock(uint32_t block, uint8_t *dst)
+{
+  if (card.readBlock(block, dst))
+    return true;
+
+  errors++;
+  return false;
+}
+
+bool card_writeBlock(uint32_t block, const uint8_t *src)
+{
+  if (card.writeBlock(block, src))
+    return true;
+
+  errors++;
+  return false;
+}
+
+bool card_contiguousFile(const char *name, uint32_t size, uint32_t *first_block, bool *created)
+{
+  *created = false;
+
+  SdFile file;
+  std::vector<CardExtent> extents;
+
+  if (file.open(&root, name, O_READ)) {
+    bool usable = file.fileSize() == size && card_extents(file.firstCluster(), size, &extents, 1);
+    uint32_t first_cluster = file.firstCluster();
+    file.close();
+
+    if (usable) {
+      *first_block = card_clusterBlock(first_cluster);
+      return true;
+    }
+
+    Serial.printf("%s isn't contiguous; recreating it\r\n", name);
+    if (!SdFile::remove(&root, name))
+      return false;
+  }
+
+  if (!file.createContiguous(&root, name, size)) {
+    Serial.printf("Failed to create %s\r\n", name);
+    return false;
+  }
+
+  *first_block = card_clusterBlock(file.firstCluster());
+  *created = true;
+  file.close();
+
+  return true;
+}
+
+bool card_createContiguous(const char *dir_name, const char *name, uint32_t size, uint32_t *first_block)
+{
+  SdFile dir;
+  if (!dir.open(&root, dir_name, O_READ))
+    return false;
+
+  SdFile file;
+  if (file.open(&dir, name, O_READ)) {
+    file.close();
+    SdFile::remove(&dir, name);
+  }
+
+  bool created = file.createContiguous(&dir, name, size);
+  if (created) {
+    *first_block = card_clusterBlock(file.firstCluster());
+    file.close();
+  } else {
+    Serial.printf("Failed to create %s/%s\r\n", dir_name, name);
+  }
+
+  dir.close();
+
+  return created;
+}
+
+// A name as a directory entry holds it: 8.3, space padded, without the dot.
+void entryName(const char *name, uint8_t *entry_name)
+{
+  memset(entry_name, ' ', 11);
+
+  const char *dot = strchr(name, '.');
+  for (uint8_t i = 0; i < 8 && name[i] && name + i != dot; i++)
+    entry_name[i] = toupper(name[i]);
+
+  for (uint8_t i = 0; dot && i < 3 && dot[i + 1]; i++)
+    entry_name[8 + i] = toupper(dot[i + 1]);
+}
+
+bool card_rename(const char *dir_name, const char *from, const char *to)
+{
+  SdFile dir;
+  if (!dir.open(&root, dir_name, O_READ))
+    return false;
+
+  dir_t entry;
+  char name[13];
+  int32_t index = -1;
+  while (dir.readDir(&entry) > 0) {
+    SdFile::dirName(entry, name);
+    if (!strcasecmp(name, from)) {
+      index = dir.curPosition() / sizeof(dir_t) - 1;
+      break;
+    }
+  }
+
+  uint32_t dir_cluster = dir.firstCluster();
+  if (index >= 0)
+    SdFile::remove(&dir, to);
+  dir.close();
+
+  if (index < 0)
+    return false;
+
+  // Follow the directory's clusters to the block holding the entry.
+  uint32_t offset = index * sizeof(dir_t);
+  uint32_t cluster_bytes = (uint32_t) volume.blocksPerCluster() * 512;
+  std::vector<CardExtent> extents;
+  if (!card_extents(dir_cluster, offset + sizeof(dir_t), &extents, 64))
+    return false;
+
+  uint32_t cluster = offset / cluster_bytes;
+  uint32_t block = 0;
+  for (auto &extent : extents) {
+    if (cluster < extent.cluster_count) {
+      block = card_clusterBlock(extent.first_cluster + cluster) + offset % cluster_bytes / 512;
+      break;
+    }
+
+    cluster -= extent.cluster_count;
+  }
+
+  if (!block)
+    return false;
+
+  // The SD library's copy of the block would otherwise be written back over
+  // the change.
+  SdVolume::cacheClear();
+
+  uint8_t data[512];
+  if (!card.readBlock(block, data))
+    return false;
+
+  entryName(to, ((dir_t *) (data + offset % 512))->name);
+
+  return card.writeBlock(block, data);
+}
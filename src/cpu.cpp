@@ -0,0 +1,105 @@
+#include <cpu.h>
+
+#include <log.h>
+
+#include <Arduino.h>
+
+// The core runs from GCLK0, which divides DPLL0's F_CPU.
+const uint8_t dividers[cpu_speed_count] = {
+  F_CPU >= 100000000 ? F_CPU / 50000000 : 1,
+  1,
+};
+
+const char *const speed_names[cpu_speed_count] = {
+  "low",
+  "full",
+};
+
+CpuSpeed speed = cpu_full;
+
+unsigned long speed_since;
+unsigned long speed_ms[cpu_speed_count];
+
+void cpu_setSpeed(CpuSpeed new_speed)
+{
+  if (new_speed == speed)
+    return;
+
+  unsigned long now = millis();
+  speed_ms[speed] += now - speed_since;
+  speed_since = now;
+
+  speed = new_speed;
+
+#if defined(__SAMD51__)
+  uint8_t divider = dividers[speed];
+
+  // SysTick is clocked from the core, so a millisecond is fewer ticks.
+  noInterrupts();
+  GCLK->GENCTRL[0].bit.DIV = divider;
+  while (GCLK->SYNCBUSY.bit.GENCTRL0);
+  SysTick->LOAD = F_CPU / divider / 1000 - 1;
+  SysTick->VAL = 0;
+  interrupts();
+#endif
+}
+
+CpuSpeed cpu_speed()
+{
+  return speed;
+}
+
+unsigned long cpu_micros()
+{
+#if defined(__SAMD51__)
+  // The core's micros(), but scaled by SysTick's reload as it is now rather
+  // than at F_CPU. Read until the tick count, SysTick and its pending
+  // interrupt agree.
+  uint32_t ticks2 = SysTick->VAL;
+  bool pend2 = SCB->ICSR & SCB_ICSR_PENDSTSET_Msk;
+  unsigned long count2 = millis();
+
+  uint32_t ticks;
+  bool pend;
+  unsigned long count;
+  do {
+    ticks = ticks2;
+    pend = pend2;
+    count = count2;
+    ticks2 = SysTick->VAL;
+    pend2 = SCB->ICSR & SCB_ICSR_PENDSTSET_Msk;
+    count2 = millis();
+  } while (pend != pend2 || count != count2 || ticks < ticks2);
+
+  uint32_t load = SysTick->LOAD;
+  return (count + pend) * 1000 + (load - ticks) * 1000 / (load + 1);
+#else
+  return micros();
+#endif
+}
+
+void cpu_delayMicroseconds(uint32_t us)
+{
+  delayMicroseconds(us / dividers[speed]);
+}
+
+void cpu_report()
+{
+  unsigned long now = millis();
+  speed_ms[speed] += now - speed_since;
+  speed_since = now;
+
+  unsigned long total = 0;
+  for (uint8_t i = 0; i < cpu_speed_count; i++)
+    total += speed_ms[i];
+
+  char line[128];
+  size_t length = 0;
+  for (uint8_t i = 0; i < cpu_speed_count; i++) {
+    length += snprintf(line + length, sizeof(line) - length, " | %s %lu MHz %lu ms (%.0f%%)", speed_names[i],
+                       F_CPU / dividers[i] / 1000000, speed_ms[i], speed_ms[i] * 100.0f / max(total, 1ul));
+    speed_ms[i] = 0;
+  }
+
+  LOG_INFO("CPU%s\r\n", line);
+}
@@ -5,6 +5,7 @@
 #include <Fonts/FreeSansBold9pt7b.h>
 #include <SPI.h>
 #include <Wire.h>
+#include <cpu.h>
 #include <led.h>
 
 const int no_display[] = {long_blink_ms, short_blink_ms, short_blink_ms, 0};
@@ -143,8 +144,15 @@ const GFXfont *font = &FreeSansBold9pt7b;
 const uint8_t text_size = 1;
 const uint8_t scroll_frame_count = 1;
 
+// The bottom line stops short of the bottom of the display to leave room for
+// the progress bar.
+const int progress_height = 2;
+
 ScrollArea topLines(0, 48, font, text_size, scroll_frame_count);
-ScrollArea bottomLine(48, 16, font, text_size, scroll_frame_count);
+ScrollArea bottomLine(48, 16 - progress_height, font, text_size, scroll_frame_count);
+
+// Pixels of the progress bar shown, or -1 if it's hidden.
+int progress_width = -1;
 
 bool display_setup()
 {
@@ -173,14 +181,44 @@ bool display_setup()
  * top displays within 3 lines; bottom within 1.
  * Returns whether the display was updated.
  */
-bool display_text(const char* top, const char* bottom)
+bool display_text(const char* top, const char* bottom, float progress)
 {
   // Avoid lazy evaluation to ensure both lines evaluate whether to update.
   bool display_changed = topLines.Display(top);
   display_changed |= bottomLine.Display(bottom);
 
+  // Only redraw the bar when it changes by a pixel.
+  int width = progress < 0 ? -1 : (int) (progress * display_width);
+  if (width != progress_width) {
+    display.fillRect(0, display_height - progress_height, display_width, progress_height, SH110X_BLACK);
+    if (width > 0)
+      display.fillRect(0, display_height - progress_height, width, progress_height, SH110X_WHITE);
+
+    progress_width = width;
+    display_changed = true;
+  }
+
   if (display_changed)
     display.display();
 
   return display_changed;
 }
+
+void display_timeFlush(unsigned long *full_us, unsigned long *partial_us)
+{
+  // Redrawing pixels as they are marks them changed, and the display only
+  // sends what changed: opposite corners cover the whole screen.
+  display.drawPixel(0, 0, display.getPixel(0, 0));
+  display.drawPixel(display_width - 1, display_height - 1,
+                    display.getPixel(display_width - 1, display_height - 1));
+
+  unsigned long start = cpu_micros();
+  display.display();
+  *full_us = cpu_micros() - start;
+
+  display.drawPixel(0, 0, display.getPixel(0, 0));
+
+  start = cpu_micros();
+  display.display();
+  *partial_us = cpu_micros() - start;
+}
@@ -1,7 +1,9 @@
 #include <encoder.h>
 
 #include <constants.h>
+#include <cpu.h>
 #include <display.h>
+#include <latency.h>
 #include <led.h>
 
 #include <Debouncer.h>
@@ -19,8 +21,19 @@ seesaw_NeoPixel sspixel = seesaw_NeoPixel(1);
 
 int32_t encoder_position;
 
+// Turning faster than this many detents per second moves further per detent,
+// up to max_acceleration times as far.
+const float acceleration_speed = 20.0f;
+const float max_acceleration = 8.0f;
+
 Debouncer encoderButton(debounce_ms);
 
+const unsigned long long_press_ms = 600;
+
+// Set when the knob is turned while held, so releasing it isn't a press of
+// either length.
+bool press_used = false;
+
 bool encoder_setup()
 {
     // Search for Seesaw device
@@ -56,33 +69,75 @@ bool encoder_setup()
   return true;
 }
 
-bool encoder_togglePause()
+EncoderPress encoder_getPress()
 {
-  static bool paused = false;
+  static unsigned long press_start;
 
-  if (!(encoderButton.update(ss.digitalRead(seesaw_switch_pin)) && !encoderButton.get()))
-    return false;
+  bool changed = encoderButton.update(ss.digitalRead(seesaw_switch_pin));
+  // Pulled up, so low when pressed.
+  bool pressed = !encoderButton.get();
+
+  if (changed && pressed) {
+    press_start = millis();
+    press_used = false;
+    return press_none;
+  }
 
-  paused = !paused;
+  if (!changed || pressed || press_used)
+    return press_none;
 
-  // Red if paused, and off if not.
+  return millis() - press_start >= long_press_ms ? press_long : press_short;
+}
+
+bool encoder_held()
+{
+  return !encoderButton.get();
+}
+
+bool encoder_buttonDown()
+{
+  // Pulled up, so low when pressed.
+  return !ss.digitalRead(seesaw_switch_pin);
+}
+
+void encoder_showPaused(bool paused)
+{
   if (paused) {
     sspixel.setPixelColor(0, 0xff0000);
     sspixel.show();
   } else {
     encoder_led_off();
   }
-
-  return true;
 }
 
-int encoder_getChange()
+int encoder_getChange(bool accelerated)
 {
+  static unsigned long last_poll_millis;
+
+  unsigned long now = millis();
+  unsigned long elapsed_ms = max(now - last_poll_millis, 1ul);
+  last_poll_millis = now;
+
+  unsigned long poll_start = cpu_micros();
   auto new_position = ss.getEncoderPosition();
   auto encoder_change = new_position - encoder_position;
   encoder_position = new_position;
 
-  return encoder_change;
+  if (encoder_change)
+    latency_begin(poll_start);
+
+  if (encoder_change && encoder_held())
+    press_used = true;
+
+  if (!accelerated || !encoder_change)
+    return encoder_change;
+
+  float speed = abs(encoder_change) * 1000.0f / elapsed_ms;
+  if (speed <= acceleration_speed)
+    return encoder_change;
+
+  float acceleration = min(speed / acceleration_speed, max_acceleration);
+  return (int) roundf(encoder_change * acceleration);
 }
 
 void encoder_led_off()
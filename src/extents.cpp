@@ -0,0 +1,81 @@
+#include <extents.h>
+
+bool extents_build(const FatGeometry &geometry, BlockReader read_block, uint32_t first_cluster,
+                   uint32_t size, std::vector<CardExtent> *extents, size_t max_extents)
+{
+  extents->clear();
+  if (!size)
+    return true;
+
+  if (geometry.fat_type != 16 && geometry.fat_type != 32)
+    return false;
+
+  uint32_t cluster_bytes = (uint32_t) geometry.blocks_per_cluster * 512;
+  uint32_t cluster_count = (size + cluster_bytes - 1) / cluster_bytes;
+
+  // Consecutive entries usually share a FAT block, so only read it when the
+  // chain moves to another one.
+  uint8_t fat_block[512];
+  uint32_t loaded_fat_block = 0xFFFFFFFF;
+
+  uint32_t cluster = first_cluster;
+  for (uint32_t i = 0; i < cluster_count; i++) {
+    // Free, reserved, bad, or end of chain before the end of the file.
+    if (cluster < 2 || cluster > geometry.cluster_count + 1)
+      return false;
+
+    if (!extents->empty() && extents->back().first_cluster + extents->back().cluster_count == cluster) {
+      extents->back().cluster_count++;
+    } else {
+      if (extents->size() == max_extents)
+        return false;
+
+      extents->push_back(CardExtent{cluster, 1});
+    }
+
+    if (i + 1 == cluster_count)
+      break;
+
+    uint32_t entry_offset = cluster * (geometry.fat_type == 16 ? 2 : 4);
+    uint32_t block = geometry.fat_start_block + entry_offset / 512;
+    if (block != loaded_fat_block) {
+      if (!read_block(block, fat_block))
+        return false;
+
+      loaded_fat_block = block;
+    }
+
+    const uint8_t *entry = fat_block + entry_offset % 512;
+    if (geometry.fat_type == 16) {
+      cluster = entry[0] | entry[1] << 8;
+    } else {
+      cluster = (entry[0] | entry[1] << 8 | (uint32_t) entry[2] << 16 | (uint32_t) entry[3] << 24) & 0x0FFFFFFF;
+    }
+  }
+
+  return true;
+}
+
+bool extents_locate(const std::vector<CardExtent> &extents, uint8_t blocks_per_cluster, uint32_t file_block,
+                    ExtentCursor *cursor, uint32_t *first_cluster, uint32_t *block_offset)
+{
+  // Rewind the cursor when seeking backwards.
+  if (file_block < cursor->start_block) {
+    cursor->index = 0;
+    cursor->start_block = 0;
+  }
+
+  if (cursor->index >= extents.size())
+    return false;
+
+  while (file_block >= cursor->start_block + extents[cursor->index].cluster_count * blocks_per_cluster) {
+    cursor->start_block += extents[cursor->index].cluster_count * blocks_per_cluster;
+    if (++cursor->index == extents.size())
+      return false;
+  }
+
+  *first_cluster = extents[cursor->index].first_cluster;
+  *block_offset = file_block - cursor->start_block;
+
+  return true;
+}
@@ -0,0 +1,132 @@
+#include <io.h>
+
+#include <cpu.h>
+#include <log.h>
+#include <stream.h>
+
+#include <Arduino.h>
+
+const unsigned long budget_window_us = 1000000;
+
+// Card time each class may use per window. Audio is never held back.
+const unsigned long budget_us[io_class_count] = {
+  budget_window_us,
+  800000,
+  600000,
+};
+
+const char *const class_names[io_class_count] = {
+  "audio",
+  "interactive",
+  "background",
+};
+
+struct ClassStats {
+  uint32_t operations;
+  unsigned long busy_us;
+  // From io_begin() to the work starting, while audio is read first.
+  unsigned long wait_us;
+  unsigned long max_wait_us;
+  // Work begun and not yet ended, counting nested work.
+  uint8_t depth;
+  uint8_t max_depth;
+  // Work that ended with the class over its budget.
+  uint32_t over_budget;
+};
+
+ClassStats stats[io_class_count];
+unsigned long started_us[io_class_count];
+
+unsigned long window_start_us;
+unsigned long window_busy_us[io_class_count];
+
+void rollWindow()
+{
+  unsigned long now = cpu_micros();
+  if (now - window_start_us < budget_window_us)
+    return;
+
+  window_start_us = now;
+  for (uint8_t i = 0; i < io_class_count; i++)
+    window_busy_us[i] = 0;
+}
+
+void io_poll()
+{
+  unsigned long start = cpu_micros();
+  uint8_t blocks = stream_refill();
+  if (!blocks)
+    return;
+
+  unsigned long busy = cpu_micros() - start;
+  stats[io_audio].operations += blocks;
+  stats[io_audio].busy_us += busy;
+
+  rollWindow();
+  window_busy_us[io_audio] += busy;
+}
+
+bool io_available(IoClass io_class)
+{
+  rollWindow();
+  return window_busy_us[io_class] < budget_us[io_class];
+}
+
+void io_begin(IoClass io_class)
+{
+  ClassStats &s = stats[io_class];
+  s.depth++;
+  s.max_depth = max(s.max_depth, s.depth);
+
+  // Work nested in the same class is timed as part of the outer piece.
+  if (s.depth > 1)
+    return;
+
+  unsigned long request = cpu_micros();
+  if (io_class != io_audio)
+    io_poll();
+
+  started_us[io_class] = cpu_micros();
+
+  unsigned long wait = started_us[io_class] - request;
+  s.wait_us += wait;
+  s.max_wait_us = max(s.max_wait_us, wait);
+}
+
+void io_end(IoClass io_class)
+{
+  ClassStats &s = stats[io_class];
+  if (--s.depth)
+    return;
+
+  unsigned long busy = cpu_micros() - started_us[io_class];
+  s.operations++;
+  s.busy_us += busy;
+
+  rollWindow();
+  window_busy_us[io_class] += busy;
+  if (window_busy_us[io_class] > budget_us[io_class])
+    s.over_budget++;
+}
+
+void io_report()
+{
+  uint8_t lowest_blocks;
+  uint32_t interrupt_reads;
+  stream_bufferStats(&lowest_blocks, &interrupt_reads);
+
+  LOG_INFO("Card I/O:\r\n");
+  for (uint8_t i = 0; i < io_class_count; i++) {
+    ClassStats &s = stats[i];
+    LOG_INFO("  %-11s %5lu ops %6.1f ms, wait mean %6.1f max %6.1f ms, depth %u, over budget %lu\r\n",
+             class_names[i], s.operations, s.busy_us / 1000.0f,
+             s.wait_us / 1000.0f / max(s.operations, (uint32_t) 1), s.max_wait_us / 1000.0f,
+             s.max_depth, s.over_budget);
+
+    uint8_t depth = s.depth;
+    s = ClassStats{};
+    s.depth = depth;
+    s.max_depth = depth;
+  }
+  LOG_INFO("  read-ahead low %u blocks, %lu reads by the interrupt\r\n", lowest_blocks, interrupt_reads);
+}
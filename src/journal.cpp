@@ -0,0 +1,161 @@
+#include <journal.h>
+
+#include <card.h>
+#include <log.h>
+
+#include <Arduino.h>
+
+const char *const journalFilename = "JOURNAL.BIN";
+
+// At a record every few seconds, this goes round every few minutes.
+const uint16_t journal_blocks = 64;
+const uint16_t block_size = 512;
+const uint32_t journal_magic = 0x314E524A; // "JRN1"
+
+// What's in each block. The sequence number says which slot a record goes
+// in, so a reader can tell where the newest is.
+struct JournalBlock {
+  uint32_t magic;
+  uint32_t sequence;
+  JournalRecord record;
+  uint32_t checksum;
+};
+
+uint32_t journal_start_block;
+bool journal_ready = false;
+
+// Next sequence number, and whether a record has been found or written.
+uint32_t next_sequence;
+bool have_record;
+JournalRecord newest;
+
+uint32_t blockChecksum(const JournalBlock &block)
+{
+  // FNV-1a over everything before the checksum.
+  uint32_t hash = 2166136261u;
+  const uint8_t *bytes = (const uint8_t*) &block;
+  for (size_t i = 0; i < offsetof(JournalBlock, checksum); i++)
+    hash = (hash ^ bytes[i]) * 16777619u;
+
+  return hash;
+}
+
+// Read the block in a slot. Returns false if it doesn't hold a valid record.
+bool readSlot(uint16_t slot, JournalBlock *block)
+{
+  uint8_t buf[block_size];
+  if (!card_readBlock(journal_start_block + slot, buf))
+    return false;
+
+  memcpy(block, buf, sizeof(*block));
+
+  return block->magic == journal_magic && block->checksum == blockChecksum(*block) &&
+         block->sequence % journal_blocks == slot;
+}
+
+// Find the newest valid record by reading every slot. For when slot 0 was
+// torn by a reset mid-write, and the binary search has nothing to start
+// from. Returns false if no slot holds a record.
+bool scanSlots(JournalBlock *newest_block, uint16_t *newest_slot)
+{
+  bool found = false;
+  JournalBlock block;
+  for (uint16_t slot = 0; slot < journal_blocks; slot++) {
+    if (!readSlot(slot, &block) || (found && block.sequence <= newest_block->sequence))
+      continue;
+
+    *newest_block = block;
+    *newest_slot = slot;
+    found = true;
+  }
+
+  return found;
+}
+
+bool journal_begin()
+{
+  journal_ready = false;
+  have_record = false;
+  next_sequence = 0;
+
+  bool created;
+  if (!card_contiguousFile(journalFilename, (uint32_t) journal_blocks * block_size,
+                           &journal_start_block, &created)) {
+    return false;
+  }
+
+  // Clear leftovers from whatever used those blocks before.
+  if (created) {
+    uint8_t zero[block_size] = {};
+    for (uint16_t slot = 0; slot < journal_blocks; slot++) {
+      if (!card_writeBlock(journal_start_block + slot, zero))
+        return false;
+    }
+  }
+
+  journal_ready = true;
+
+  // Slot 0 holds the oldest record of the current lap around the ring. Each
+  // slot after it holds the next sequence number up to the newest record;
+  // after that are records from the previous lap, or nothing. Binary search
+  // for the last slot that follows on from slot 0.
+  JournalBlock block;
+  JournalBlock last;
+  uint16_t low = 0;
+  if (readSlot(0, &block)) {
+    uint32_t lap_start = block.sequence;
+    last = block;
+    uint16_t high = journal_blocks;
+    while (high - low > 1) {
+      uint16_t middle = (low + high) / 2;
+      if (readSlot(middle, &block) && block.sequence == lap_start + middle) {
+        low = middle;
+        last = block;
+      } else {
+        high = middle;
+      }
+    }
+  } else if (!scanSlots(&last, &low)) {
+    return true;
+  }
+
+  newest = last.record;
+  newest.filename[sizeof(newest.filename) - 1] = '\0';
+  have_record = true;
+  next_sequence = last.sequence + 1;
+
+  LOG_INFO("Journal: record %lu in slot %u\r\n", last.sequence, low);
+
+  return true;
+}
+
+bool journal_read(JournalRecord *record)
+{
+  if (!have_record)
+    return false;
+
+  *record = newest;
+  return true;
+}
+
+bool journal_write(const JournalRecord &record)
+{
+  if (!journal_ready)
+    return false;
+
+  uint8_t buf[block_size] = {};
+  JournalBlock *block = (JournalBlock*) buf;
+  block->magic = journal_magic;
+  block->sequence = next_sequence;
+  block->record = record;
+  block->checksum = blockChecksum(*block);
+
+  if (!card_writeBlock(journal_start_block + next_sequence % journal_blocks, buf))
+    return false;
+
+  next_sequence++;
+  newest = record;
+  have_record = true;
+
+  return true;
+}
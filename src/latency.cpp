@@ -0,0 +1,102 @@
+#include <latency.h>
+
+#include <cpu.h>
+#include <log.h>
+
+#include <Arduino.h>
+#include <algorithm>
+
+// Times kept per stage for the distribution.
+const uint8_t history_size = 32;
+
+// Time each stage takes after the one before it is named after the later.
+const char *const stage_names[latency_stage_count] = {
+  "poll",
+  "i2c read",
+  "dispatch",
+  "settle",
+  "cancel",
+  "open",
+  "first data",
+  "decode",
+};
+
+// Trace in progress. next_stage is latency_stage_count when there isn't one.
+volatile uint8_t next_stage = latency_stage_count;
+volatile unsigned long stage_micros[latency_stage_count];
+
+// Recent stage times in microseconds, and the total for each change.
+uint32_t history[latency_stage_count][history_size];
+uint32_t totals[history_size];
+uint8_t history_length;
+uint8_t history_next;
+uint32_t traces_completed;
+uint32_t traces_reported;
+
+void latency_begin(unsigned long poll_start_us)
+{
+  noInterrupts();
+  stage_micros[latency_poll] = poll_start_us;
+  stage_micros[latency_input] = cpu_micros();
+  next_stage = latency_selected;
+  interrupts();
+}
+
+void finishTrace()
+{
+  for (uint8_t stage = latency_input; stage < latency_stage_count; stage++)
+    history[stage][history_next] = stage_micros[stage] - stage_micros[stage - 1];
+  totals[history_next] = stage_micros[latency_decoding] - stage_micros[latency_poll];
+
+  history_next = (history_next + 1) % history_size;
+  history_length = min(history_length + 1, (int) history_size);
+  traces_completed++;
+}
+
+void latency_mark(LatencyStage stage)
+{
+  if (next_stage != stage)
+    return;
+
+  stage_micros[stage] = cpu_micros();
+  next_stage = stage + 1;
+
+  if (stage == latency_decoding)
+    finishTrace();
+}
+
+bool latency_waiting(LatencyStage stage)
+{
+  return next_stage == stage;
+}
+
+void logDistribution(const char *name, const uint32_t *times)
+{
+  uint32_t sorted[history_size];
+  std::copy(times, times + history_length, sorted);
+  std::sort(sorted, sorted + history_length);
+
+  uint64_t sum = 0;
+  for (uint8_t i = 0; i < history_length; i++)
+    sum += sorted[i];
+
+  LOG_INFO("  %-10s min %6.1f p50 %6.1f p90 %6.1f max %6.1f mean %6.1f ms\r\n", name,
+           sorted[0] / 1000.0f,
+           sorted[history_length / 2] / 1000.0f,
+           sorted[history_length * 9 / 10] / 1000.0f,
+           sorted[history_length - 1] / 1000.0f,
+           sum / 1000.0f / history_length);
+}
+
+void latency_report()
+{
+  if (traces_completed == traces_reported)
+    return;
+
+  traces_reported = traces_completed;
+
+  LOG_INFO("Song change latency over the last %u changes:\r\n", history_length);
+  for (uint8_t stage = latency_input; stage < latency_stage_count; stage++)
+    logDistribution(stage_names[stage], history[stage]);
+  logDistribution("total", totals);
+}
@@ -0,0 +1,137 @@
+#include <log.h>
+
+#include <Arduino.h>
+#include <stdarg.h>
+
+// A power of two, so the free running indices wrap cleanly.
+const uint32_t ring_size = 4096;
+// Longest formatted message; longer ones are cut short.
+const size_t max_message_length = 160;
+
+// Text is stored as is. Events start with a 0 byte, which text doesn't
+// contain, followed by an Event.
+const uint8_t event_marker = 0;
+
+struct Event {
+  const char *format;
+  uint32_t a;
+  uint32_t b;
+};
+
+static uint8_t ring[ring_size];
+static uint32_t head;
+static uint32_t tail;
+
+static uint32_t dropped;
+static uint32_t reported_dropped;
+
+// A formatted event, or drop report, partly written to the port.
+static char pending[max_message_length];
+static size_t pending_length;
+static size_t pending_sent;
+
+static bool append(const uint8_t *data, size_t length)
+{
+  if (ring_size - (head - tail) < length) {
+    dropped++;
+    return false;
+  }
+
+  for (size_t i = 0; i < length; i++)
+    ring[(head + i) % ring_size] = data[i];
+
+  head += length;
+
+  return true;
+}
+
+void log_printf(const char *format, ...)
+{
+  char message[max_message_length];
+
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(message, sizeof(message), format, args);
+  va_end(args);
+
+  if (length <= 0)
+    return;
+
+  append((const uint8_t*) message, min((size_t) length, sizeof(message) - 1));
+}
+
+void log_event(const char *format, uint32_t a, uint32_t b)
+{
+  uint8_t record[1 + sizeof(Event)];
+  Event event = {format, a, b};
+
+  record[0] = event_marker;
+  memcpy(record + 1, &event, sizeof(event));
+
+  append(record, sizeof(record));
+}
+
+// Send what's left of the pending message. Returns whether it's all gone.
+static bool sendPending(int *available)
+{
+  size_t length = min((size_t) *available, pending_length - pending_sent);
+  Serial.write((const uint8_t*) pending + pending_sent, length);
+
+  pending_sent += length;
+  *available -= length;
+
+  return pending_sent == pending_length;
+}
+
+void log_drain()
+{
+  int available = Serial.availableForWrite();
+
+  if (pending_sent < pending_length && !sendPending(&available))
+    return;
+
+  while (available > 0 && tail != head) {
+    if (ring[tail % ring_size] == event_marker) {
+      Event event;
+      for (size_t i = 0; i < sizeof(event); i++)
+        ((uint8_t*) &event)[i] = ring[(tail + 1 + i) % ring_size];
+
+      tail += 1 + sizeof(event);
+
+      int length = snprintf(pending, sizeof(pending), event.format,
+                            (unsigned long) event.a, (unsigned long) event.b);
+      pending_length = min((size_t) max(length, 0), sizeof(pending) - 1);
+      pending_sent = 0;
+
+      if (!sendPending(&available))
+        return;
+
+      continue;
+    }
+
+    // A run of text, up to the next event or the end of the ring.
+    uint8_t chunk[64];
+    size_t length = 0;
+    while (length < sizeof(chunk) && (int) length < available && tail != head &&
+           ring[tail % ring_size] != event_marker) {
+      chunk[length++] = ring[tail % ring_size];
+      tail++;
+    }
+
+    Serial.write(chunk, length);
+    available -= length;
+  }
+
+  // Say how much was lost once there's room again.
+  if (dropped != reported_dropped && tail == head) {
+    pending_length = snprintf(pending, sizeof(pending), "[%lu log messages dropped]\r\n",
+                              (unsigned long) (dropped - reported_dropped));
+    pending_sent = 0;
+    reported_dropped = dropped;
+  }
+}
+
+uint32_t log_dropped()
+{
+  return dropped;
+}
@@ -1,8 +1,18 @@
+#include <benchmark.h>
+#include <boot.h>
+#include <calibration.h>
 #include <constants.h>
+#include <cpu.h>
 #include <display.h>
 #include <encoder.h>
+#include <io.h>
+#include <latency.h>
 #include <led.h>
+#include <log.h>
 #include <mass_storage.h>
+#include <sci.h>
+#include <settings.h>
+#include <ui.h>
 #include <vs1053.h>
 
 #include <Adafruit_SleepyDog.h>
@@ -13,13 +23,19 @@
 // Updating the display is usually at or just under this duration.
 const unsigned long target_frametime_micros = 70000;
 
+const int watchdog_timeout_ms = 4000;
+
+// Frame time kept back from a background import for logging and timing
+// jitter.
+const unsigned long import_margin_micros = 10000;
+
 // Blink codes for startup situations
 const int waiting_for_serial[] = {short_blink_ms, 0};
 
 void setup()
 {
-  auto start = micros();
   mass_storage_setup();
+  boot_stage("USB");
 
   Serial.begin(9600);
 
@@ -27,8 +43,6 @@ void setup()
   display_setup();
   display_text("Hello there", booting);
 
-  vs1053_setup();
-
 #if 0
   // Blink while waiting for serial connection
   if (!Serial) {
@@ -43,30 +57,41 @@ void setup()
   // First attempts didn't retry until success; try harder to make sure it's ready.
   while (!display_setup())
     Serial.println("Display setup failed");
+  boot_stage("display");
 
   while (!vs1053_setup())
     Serial.println("VS1053 setup failed");
 
   while (!encoder_setup())
     Serial.println("Cannot find encoder");
+  boot_stage("encoder");
+
+  settings_load();
+  boot_stage("settings");
+
+  calibration_begin();
+  boot_stage("SPI calibration");
 
+  benchmark_runIfRequested();
+  boot_stage("benchmark");
+
+  // Starts playing where it was before the reset while the library loads.
   vs1053_loadSongs();
 
   // Enable watchdog before entering loop()
-  int countdown_milliseconds = Watchdog.enable(4000);
+  int countdown_milliseconds = Watchdog.enable(watchdog_timeout_ms);
   Serial.print("Watchdog timer set for ");
   Serial.print(countdown_milliseconds);
   Serial.println(" milliseconds");
 
-  Serial.print("Startup completed in ");
-  Serial.print((micros() - start) / 1000);
-  Serial.println(" milliseconds");
-
   led_off();
   encoder_led_off();
 
-  // Start the first song.
-  vs1053_changeSong(0);
+  // Pick up where playback was before the reset.
+  vs1053_start();
+  boot_stage("start");
+
+  boot_report();
 }
 
 void loop()
@@ -77,36 +102,53 @@ void loop()
   static int idle_frame_time_index = 0;
   const unsigned long frame_time_report_interval_ms = 5000;
   static unsigned long last_frame_time_report;
-  static bool paused = false;
 
-  unsigned long start_micros = micros();
+  unsigned long start_micros = cpu_micros();
   unsigned long start = millis();
 
   Watchdog.reset();
 
   // Switch to mass storage mode on button press. This is a separate mode so
   // that music playback isn't interrupted by mass storage CPU load.
-  // mass_storage_mode() does not return; a second button press resets the board.
+  // mass_storage_mode() returns on a second button press, and playback picks
+  // up where it was.
   if (mass_storage_button()) {
-    vs1053_pause(true);
-    mass_storage_mode();
-  }
+    cpu_setSpeed(cpu_full);
+    vs1053_suspend();
+    bool card_modified = mass_storage_mode();
+
+    auto resume_start = millis();
+    if (!vs1053_resume(card_modified)) {
+      Serial.println("Failed to resume after mass storage; resetting");
+      mass_storage_reset();
+    }
 
-  // Toggle pause on encoder button press.
-  // Ignore encoder movement while the knob switch is changing - the position
-  // can become unstable.
-  if (encoder_togglePause()) {
-    paused = !paused;
-    vs1053_pause(paused);
-  } else {
-    auto change = encoder_getChange();
-    if (!paused && change != 0)
-      vs1053_changeSong(change);
+    LOG_INFO("Resumed from mass storage in %lu ms\r\n", millis() - resume_start);
+
+    Watchdog.enable(watchdog_timeout_ms);
+
+    // Don't count the time in mass storage mode as a frame.
+    start_micros = cpu_micros();
+    start = millis();
   }
 
-  bool display_updated = vs1053_loop();
+  // Playback alone can run slowly; importing can't.
+  cpu_setSpeed(vs1053_importing() ? cpu_full : cpu_low);
 
-  Serial.flush();
+  calibration_loop();
+
+  // Read ahead for the playing song before anything else uses the card.
+  io_poll();
+
+  bool display_updated = ui_loop();
+
+  // Import part of the library, if it's being imported, in what's left of
+  // the frame.
+  unsigned long elapsed_micros = cpu_micros() - start_micros;
+  if (elapsed_micros + import_margin_micros < target_frametime_micros)
+    vs1053_import(target_frametime_micros - import_margin_micros - elapsed_micros);
+  else
+    vs1053_import(0);
 
   unsigned long end = millis();
   unsigned long frame_time = end - start;
@@ -128,12 +170,16 @@ void loop()
       if (idle_frame_times[i] > max_idle) max_idle = idle_frame_times[i];
     }
 
-    char buf[512];
-    snprintf(buf, sizeof(buf), "DISPLAY mean %02.1f ms, max %02lu ms | IDLE %02.1f ms, max %02lu ms \r\n",
+    LOG_INFO("DISPLAY mean %02.1f ms, max %02lu ms | IDLE %02.1f ms, max %02lu ms | SCI %u/s | log dropped %lu\r\n",
              total / max((float)frame_time_index, 1.0f),
              max_display,
              idle_total / max((float)idle_frame_time_index, 1.0f),
-             max_idle);
+             max_idle,
+             sci_transactionsPerSecond(),
+             log_dropped());
+    latency_report();
+    io_report();
+    cpu_report();
 
     last_frame_time_report = end;
 
@@ -149,12 +195,16 @@ void loop()
   if (display_updated) frame_times[frame_time_index++] = frame_time;
   else idle_frame_times[idle_frame_time_index++] = frame_time;
 
-  // If this frame completed faster than the target, wait before starting the
-  // next.
-  auto micros_frame_time = micros() - start_micros;
+  // If this frame completed faster than the target, send logs and wait
+  // before starting the next.
+  auto micros_frame_time = cpu_micros() - start_micros;
   if (micros_frame_time < target_frametime_micros) {
-    delayMicroseconds(target_frametime_micros - micros_frame_time);
+    log_drain();
+
+    micros_frame_time = cpu_micros() - start_micros;
+    if (micros_frame_time < target_frametime_micros)
+      cpu_delayMicroseconds(target_frametime_micros - micros_frame_time);
   } else {
-    Serial.printf("Long frame! %lu us\r\n", micros_frame_time);
+    LOG_EVENT(LOG_LEVEL_WARN, "Long frame! %lu us\r\n", micros_frame_time);
   }
 }
@@ -11,6 +11,7 @@
 
 #include <mass_storage.h>
 
+#include <card.h>
 #include <constants.h>
 #include <display.h>
 #include <vs1053.h>
@@ -19,6 +20,7 @@
 #include <Adafruit_TinyUSB.h>
 #include <SD.h>
 #include <Switch.h>
+#include <algorithm>
 
 // Feather ESP32
 #if defined(ESP32) && !defined(ARDUINO_ADAFRUIT_FEATHER_ESP32S2)
@@ -37,12 +39,10 @@ const char* const sd_card_mode = "Card";
 
 Adafruit_USBD_MSC usb_msc;
 
-Sd2Card card;
-SdVolume volume;
-
 Switch massStorageButton(massStorageButtonPin);
 
 bool mass_storage_begin(uint8_t);
+void mass_storage_end();
 int32_t msc_read_cb(uint32_t, void*, uint32_t);
 int32_t msc_write_cb(uint32_t, uint8_t*, uint32_t);
 void msc_flush_cb();
@@ -51,6 +51,267 @@ void TimerHandler();
 volatile unsigned int read_count = 0;
 volatile unsigned int write_count = 0;
 
+// SD block size is always 512.
+const uint16_t block_size = 512;
+
+// The cache is allocated on entering mass storage mode so that it costs
+// nothing during playback. Try the largest size first, and halve it until the
+// allocation fits in what's left of SRAM.
+const uint16_t max_cached_blocks = 128;
+const uint16_t min_cached_blocks = 16;
+
+struct CachedBlock {
+  uint32_t lba;
+  uint32_t last_used;
+  bool valid;
+  bool dirty;
+  uint8_t data[block_size];
+};
+
+/*
+ * RAM cache in front of the card. Hosts re-read FAT and directory blocks over
+ * and over while mounting and copying, so metadata blocks are kept in
+ * preference to file data. Writes are held until flush() so that runs of
+ * consecutive blocks go to the card as a single multi-block write.
+ */
+class BlockCache {
+private:
+  CachedBlock *blocks = NULL;
+  uint16_t block_count = 0;
+  // Indices of dirty blocks, sorted by LBA during flush().
+  uint16_t *flush_order = NULL;
+  uint32_t use_counter = 0;
+
+  // Pinned region: everything before the data area (boot sector, FATs, and
+  // the FAT16 root directory), plus the first cluster of a FAT32 root
+  // directory.
+  uint32_t metadata_end = 0;
+  uint32_t root_start = 0;
+  uint32_t root_end = 0;
+
+  bool isMetadata(uint32_t lba)
+  {
+    return lba < metadata_end || (lba >= root_start && lba < root_end);
+  }
+
+  CachedBlock *find(uint32_t lba)
+  {
+    for (uint16_t i = 0; i < block_count; i++) {
+      if (blocks[i].valid && blocks[i].lba == lba)
+        return &blocks[i];
+    }
+
+    return NULL;
+  }
+
+  // Choose a block to replace: an empty one if possible, otherwise the least
+  // recently used clean file data, and only then clean metadata. Returns NULL
+  // if everything is dirty.
+  CachedBlock *victim()
+  {
+    CachedBlock *data = NULL;
+    CachedBlock *metadata = NULL;
+
+    for (uint16_t i = 0; i < block_count; i++) {
+      CachedBlock *block = &blocks[i];
+      if (!block->valid)
+        return block;
+
+      if (block->dirty)
+        continue;
+
+      CachedBlock *&oldest = isMetadata(block->lba) ? metadata : data;
+      if (!oldest || block->last_used < oldest->last_used)
+        oldest = block;
+    }
+
+    return data ? data : metadata;
+  }
+
+  CachedBlock *allocate(uint32_t lba)
+  {
+    CachedBlock *block = victim();
+
+    // Full of dirty blocks - write them out to make room.
+    if (!block) {
+      if (!flush())
+        return NULL;
+
+      block = victim();
+    }
+
+    block->lba = lba;
+    block->valid = false;
+    block->dirty = false;
+
+    return block;
+  }
+
+public:
+  unsigned int hits = 0;
+  unsigned int misses = 0;
+  unsigned int flushed_blocks = 0;
+  unsigned int flushed_runs = 0;
+
+  bool begin(SdVolume &volume)
+  {
+    for (block_count = max_cached_blocks; block_count >= min_cached_blocks; block_count /= 2) {
+      blocks = (CachedBlock*) malloc(block_count * sizeof(CachedBlock));
+      flush_order = (uint16_t*) malloc(block_count * sizeof(uint16_t));
+      if (blocks && flush_order)
+        break;
+
+      free(blocks);
+      free(flush_order);
+      blocks = NULL;
+      flush_order = NULL;
+    }
+
+    if (!blocks) {
+      block_count = 0;
+      Serial.println("Block cache allocation failed; continuing uncached");
+      return false;
+    }
+
+    for (uint16_t i = 0; i < block_count; i++) {
+      blocks[i].valid = false;
+      blocks[i].dirty = false;
+    }
+
+    metadata_end = volume.dataStartBlock();
+    if (volume.fatType() == 32) {
+      root_start = volume.dataStartBlock() + ((volume.rootDirStart() - 2) << volume.clusterSizeShift());
+      root_end = root_start + volume.blocksPerCluster();
+    }
+
+    Serial.printf("Block cache: %u blocks (%u KiB)\r\n", block_count, (block_count * block_size) / 1024);
+
+    return true;
+  }
+
+  // Write back anything pending and release the memory for playback.
+  void end()
+  {
+    if (!blocks)
+      return;
+
+    flush();
+
+    free(blocks);
+    free(flush_order);
+    blocks = NULL;
+    flush_order = NULL;
+    block_count = 0;
+  }
+
+  bool read(uint32_t lba, uint8_t *buffer)
+  {
+    CachedBlock *block = find(lba);
+    if (block) {
+      hits++;
+      block->last_used = ++use_counter;
+      memcpy(buffer, block->data, block_size);
+      return true;
+    }
+
+    misses++;
+    if (!card.readBlock(lba, buffer))
+      return false;
+
+    if (!block_count)
+      return true;
+
+    block = allocate(lba);
+    if (!block)
+      return true;
+
+    memcpy(block->data, buffer, block_size);
+    block->valid = true;
+    block->last_used = ++use_counter;
+
+    return true;
+  }
+
+  bool write(uint32_t lba, const uint8_t *buffer)
+  {
+    if (!block_count)
+      return card.writeBlock(lba, buffer);
+
+    CachedBlock *block = find(lba);
+    if (!block)
+      block = allocate(lba);
+
+    // Couldn't make room, so write through.
+    if (!block)
+      return card.writeBlock(lba, buffer);
+
+    memcpy(block->data, buffer, block_size);
+    block->valid = true;
+    block->dirty = true;
+    block->last_used = ++use_counter;
+
+    return true;
+  }
+
+  // Write all dirty blocks, merging consecutive LBAs into multi-block writes.
+  bool flush()
+  {
+    uint16_t dirty_count = 0;
+    for (uint16_t i = 0; i < block_count; i++) {
+      if (blocks[i].valid && blocks[i].dirty)
+        flush_order[dirty_count++] = i;
+    }
+
+    if (!dirty_count)
+      return true;
+
+    std::sort(flush_order, flush_order + dirty_count,
+              [this](uint16_t a, uint16_t b) { return blocks[a].lba < blocks[b].lba; });
+
+    bool success = true;
+    for (uint16_t start = 0; start < dirty_count; ) {
+      uint16_t end = start + 1;
+      while (end < dirty_count && blocks[flush_order[end]].lba == blocks[flush_order[end - 1]].lba + 1)
+        end++;
+
+      uint16_t run_length = end - start;
+      bool run_success;
+      if (run_length == 1) {
+        run_success = card.writeBlock(blocks[flush_order[start]].lba, blocks[flush_order[start]].data);
+      } else {
+        run_success = card.writeStart(blocks[flush_order[start]].lba, run_length);
+        for (uint16_t i = start; run_success && i < end; i++)
+          run_success = card.writeData(blocks[flush_order[i]].data);
+        run_success = card.writeStop() && run_success;
+      }
+
+      if (run_success) {
+        for (uint16_t i = start; i < end; i++)
+          blocks[flush_order[i]].dirty = false;
+
+        flushed_blocks += run_length;
+        flushed_runs++;
+      } else {
+        Serial.printf("Block cache flush failed at block %lu\r\n", blocks[flush_order[start]].lba);
+        success = false;
+      }
+
+      start = end;
+    }
+
+    return success;
+  }
+
+  // Percentage of reads served from RAM.
+  unsigned int hitRate()
+  {
+    unsigned int total = hits + misses;
+    return total ? (100 * hits) / total : 0;
+  }
+};
+
+BlockCache block_cache;
+
 void mass_storage_setup()
 {
   digitalWrite(softwareResetPin, HIGH);
@@ -70,27 +331,22 @@ void mass_storage_setup()
 
 bool mass_storage_button()
 {
-  static int buttonPresses;
-
   massStorageButton.poll();
 
   if (massStorageButton.pushed()) {
-    buttonPresses++;
-
     Serial.println("Mass storage button pressed");
-
-    // Second press: reset to reload songs.
-    if (buttonPresses != 1)
-      digitalWrite(softwareResetPin, LOW);
-
-    // First press: instruct main() to start mass storage mode.
     return true;
   }
 
   return false;
 }
 
-void mass_storage_mode()
+void mass_storage_reset()
+{
+  digitalWrite(softwareResetPin, LOW);
+}
+
+bool mass_storage_mode()
 {
   Watchdog.disable();
 
@@ -105,27 +361,34 @@ void mass_storage_mode()
     while (true) led_blinkCode(no_microsd);
   }
 
+  unsigned int initial_write_count = write_count;
+
   // Show signs of life to make the wait more bearable.
   char buf[32];
   char buf2[32];
-  for (uint8_t i = 0; ; i++) {
-    sprintf(buf, "R%u W%u", read_count, write_count);
+  bool exit_requested = false;
+  for (uint8_t i = 0; !exit_requested; i++) {
+    snprintf(buf, sizeof(buf), "R%u W%u H%u%%", read_count, write_count, block_cache.hitRate());
     strcpy(buf2, sd_card_mode);
 
     for (uint8_t j = 0; j < (i % 6); j++)
       strcpy(buf2 + strlen(buf2), ".");
 
     display_text(buf, buf2);
-    for (uint8_t j = 0; j < 100; j++) {
-      mass_storage_button();
+    for (uint8_t j = 0; j < 100 && !exit_requested; j++) {
+      exit_requested = mass_storage_button();
       delay(10);
     }
   }
+
+  mass_storage_end();
+
+  return write_count != initial_write_count;
 }
 
 bool mass_storage_begin(uint8_t chipSelectPin)
 {
-  if (!card.init(SPI_FULL_SPEED, chipSelectPin))
+  if (!card_init(chipSelectPin))
   {
     Serial.println("initialization failed. Things to check:");
     Serial.println("* is a card inserted?");
@@ -145,8 +408,10 @@ bool mass_storage_begin(uint8_t chipSelectPin)
   Serial.print("Volume size (MB):  ");
   Serial.println((block_count/2) / 1024);
 
-  // Set disk size, SD block size is always 512
-  usb_msc.setCapacity(block_count, 512);
+  block_cache.begin(volume);
+
+  // Set disk size
+  usb_msc.setCapacity(block_count, block_size);
 
   // MSC is ready for read/write
   usb_msc.setUnitReady(true);
@@ -154,6 +419,14 @@ bool mass_storage_begin(uint8_t chipSelectPin)
   return true;
 }
 
+void mass_storage_end()
+{
+  // Take the card away from the host before handing it back to the player.
+  usb_msc.setUnitReady(false);
+
+  block_cache.end();
+}
+
 // Callback invoked when received READ10 command.
 // Copy disk's data to buffer (up to bufsize) and
 // return number of copied bytes (must be multiple of block size)
@@ -161,7 +434,7 @@ int32_t msc_read_cb(uint32_t lba, void* buffer, uint32_t bufsize)
 {
   read_count++;
   (void) bufsize;
-  return card.readBlock(lba, (uint8_t*) buffer) ? 512 : -1;
+  return block_cache.read(lba, (uint8_t*) buffer) ? block_size : -1;
 }
 
 // Callback invoked when received WRITE10 command.
@@ -171,12 +444,12 @@ int32_t msc_write_cb(long unsigned int lba, unsigned char *buffer, long unsigned
 {
   write_count++;
   (void) bufsize;
-  return card.writeBlock(lba, buffer) ? 512 : -1;
+  return block_cache.write(lba, buffer) ? block_size : -1;
 }
 
 // Callback invoked when WRITE10 command is completed (status received and accepted by host).
 // used to flush any pending cache.
 void msc_flush_cb()
 {
-  // nothing to do
+  block_cache.flush();
 }
@@ -0,0 +1,308 @@
+#include <mp3.h>
+
+#include <algorithm>
+#include <string.h>
+
+// kbps, by MPEG version (1, or 2 and 2.5), layer, and header bitrate index.
+const uint16_t bitrates[2][3][15] = {
+  {
+    {0, 32, 64, 96, 128, 160, 192, 224, 256, 288, 320, 352, 384, 416, 448},
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384},
+    {0, 32, 40, 48, 56, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320},
+  },
+  {
+    {0, 32, 48, 56, 64, 80, 96, 112, 128, 144, 160, 176, 192, 224, 256},
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+    {0, 8, 16, 24, 32, 40, 48, 56, 64, 80, 96, 112, 128, 144, 160},
+  },
+};
+
+// Hz, by MPEG version (1, 2, 2.5) and header sample rate index.
+const uint16_t sample_rates[3][3] = {
+  {44100, 48000, 32000},
+  {22050, 24000, 16000},
+  {11025, 12000, 8000},
+};
+
+uint32_t bigEndian32(const uint8_t *data)
+{
+  return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | data[3];
+}
+
+uint16_t bigEndian16(const uint8_t *data)
+{
+  return data[0] << 8 | data[1];
+}
+
+struct FrameHeader {
+  // 0 for MPEG 1, 1 for MPEG 2, 2 for MPEG 2.5.
+  uint8_t version;
+  // 1 to 3
+  uint8_t layer;
+  uint16_t bitrate_kbps;
+  uint16_t sample_rate;
+  bool mono;
+  uint16_t samples_per_frame;
+};
+
+uint32_t syncsafe32(const uint8_t *data)
+{
+  return (uint32_t) (data[0] & 0x7F) << 21 | (uint32_t) (data[1] & 0x7F) << 14 |
+         (data[2] & 0x7F) << 7 | (data[3] & 0x7F);
+}
+
+uint32_t mp3_id3Length(const uint8_t *data, size_t length)
+{
+  if (length < 10 || memcmp(data, "ID3", 3))
+    return 0;
+
+  // Sizes are 28 bit "syncsafe" integers, and exclude the 10 byte header and
+  // footer.
+  bool footer = data[5] & 0x10;
+
+  return 10 + syncsafe32(data + 6) + (footer ? 10 : 0);
+}
+
+uint32_t mp3_tagLength(const uint8_t *data, size_t length)
+{
+  if (length < 10 || memcmp(data, "ID3", 3))
+    return 0;
+
+  uint8_t version = data[3];
+  if (version < 2 || version > 4)
+    return 0;
+
+  size_t end = std::min((size_t) mp3_id3Length(data, length), length);
+  size_t position = 10;
+
+  // Skip an extended header. Version 4 counts the size field in the size.
+  if (version > 2 && (data[5] & 0x40)) {
+    if (position + 4 > end)
+      return 0;
+
+    position += version == 4 ? syncsafe32(data + position) : 4 + bigEndian32(data + position);
+  }
+
+  // Version 2 frames have 3 character IDs and 3 byte sizes.
+  const size_t header_length = version == 2 ? 6 : 10;
+  while (position + header_length <= end && data[position]) {
+    const uint8_t *frame = data + position;
+    uint32_t size;
+    if (version == 2)
+      size = (uint32_t) frame[3] << 16 | frame[4] << 8 | frame[5];
+    else if (version == 3)
+      size = bigEndian32(frame + 4);
+    else
+      size = syncsafe32(frame + 4);
+
+    bool tlen = version == 2 ? !memcmp(frame, "TLE", 3) : !memcmp(frame, "TLEN", 4);
+    if (tlen && position + header_length + size <= end) {
+      // An encoding byte, then digits, which are 2 bytes each in UTF-16.
+      uint32_t ms = 0;
+      for (uint32_t i = 1; i < size; i++) {
+        uint8_t c = frame[header_length + i];
+        if (c >= '0' && c <= '9')
+          ms = ms * 10 + (c - '0');
+        else if (c && c != 0xFF && c != 0xFE)
+          break;
+      }
+
+      return ms;
+    }
+
+    position += header_length + size;
+  }
+
+  return 0;
+}
+
+bool parseHeader(const uint8_t *data, FrameHeader *header)
+{
+  if (data[0] != 0xFF || (data[1] & 0xE0) != 0xE0)
+    return false;
+
+  uint8_t version_bits = (data[1] >> 3) & 3;
+  uint8_t layer_bits = (data[1] >> 1) & 3;
+  uint8_t bitrate_index = data[2] >> 4;
+  uint8_t sample_rate_index = (data[2] >> 2) & 3;
+
+  // Reserved, or free format.
+  if (version_bits == 1 || layer_bits == 0 || bitrate_index == 0 || bitrate_index == 15 ||
+      sample_rate_index == 3) {
+    return false;
+  }
+
+  header->version = version_bits == 3 ? 0 : version_bits == 2 ? 1 : 2;
+  header->layer = 4 - layer_bits;
+  header->bitrate_kbps = bitrates[header->version ? 1 : 0][header->layer - 1][bitrate_index];
+  header->sample_rate = sample_rates[header->version][sample_rate_index];
+  header->mono = (data[3] >> 6) == 3;
+
+  if (header->layer == 1)
+    header->samples_per_frame = 384;
+  else if (header->layer == 3 && header->version)
+    header->samples_per_frame = 576;
+  else
+    header->samples_per_frame = 1152;
+
+  return true;
+}
+
+// Xing/Info headers come after the side information.
+size_t xingOffset(const FrameHeader &header)
+{
+  if (header.version == 0)
+    return 4 + (header.mono ? 17 : 32);
+
+  return 4 + (header.mono ? 9 : 17);
+}
+
+bool parseXing(const uint8_t *frame, size_t length, const FrameHeader &header, Mp3Info *info)
+{
+  size_t offset = xingOffset(header);
+  if (offset + 8 > length || (memcmp(frame + offset, "Xing", 4) && memcmp(frame + offset, "Info", 4)))
+    return false;
+
+  const uint8_t *field = frame + offset + 4;
+  const uint8_t *end = frame + length;
+  uint32_t flags = bigEndian32(field);
+  field += 4;
+
+  uint32_t frames = 0;
+  if (flags & 1) {
+    if (field + 4 > end)
+      return false;
+
+    frames = bigEndian32(field);
+    field += 4;
+  }
+
+  if (flags & 2) {
+    if (field + 4 > end)
+      return false;
+
+    uint32_t bytes = bigEndian32(field);
+    field += 4;
+
+    // Trust the file size over the header when they disagree.
+    if (bytes && bytes < info->audio_bytes)
+      info->audio_bytes = bytes;
+  }
+
+  if ((flags & 4) && field + 100 <= end) {
+    memcpy(info->toc, field, 100);
+    info->has_toc = true;
+  }
+
+  if (frames)
+    info->duration_ms = (uint64_t) frames * header.samples_per_frame * 1000 / header.sample_rate;
+
+  return frames != 0;
+}
+
+bool parseVbri(const uint8_t *frame, size_t length, const FrameHeader &header, Mp3Info *info)
+{
+  const size_t offset = 4 + 32;
+  if (offset + 26 > length || memcmp(frame + offset, "VBRI", 4))
+    return false;
+
+  const uint8_t *vbri = frame + offset;
+  uint32_t bytes = bigEndian32(vbri + 10);
+  uint32_t frames = bigEndian32(vbri + 14);
+  uint16_t entry_count = bigEndian16(vbri + 18);
+  uint16_t scale = bigEndian16(vbri + 20);
+  uint16_t entry_size = bigEndian16(vbri + 22);
+  uint16_t frames_per_entry = bigEndian16(vbri + 24);
+
+  if (!frames || !bytes)
+    return false;
+
+  if (bytes < info->audio_bytes)
+    info->audio_bytes = bytes;
+
+  info->duration_ms = (uint64_t) frames * header.samples_per_frame * 1000 / header.sample_rate;
+
+  // Resample the table, which gives the bytes in each run of frames, into
+  // the Xing form. It's left out if it doesn't fit in the data given.
+  const uint8_t *entries = vbri + 26;
+  if (!entry_count || entry_size < 1 || entry_size > 4 || !frames_per_entry ||
+      entries + (size_t) entry_count * entry_size > frame + length) {
+    return true;
+  }
+
+  uint32_t entry_bytes = 0;
+  uint32_t entry_frames = 0;
+  uint16_t entry = 0;
+  for (uint8_t percent = 0; percent < 100; percent++) {
+    uint32_t target_frames = (uint64_t) frames * percent / 100;
+
+    while (entry < entry_count && entry_frames + frames_per_entry <= target_frames) {
+      uint32_t value = 0;
+      for (uint16_t i = 0; i < entry_size; i++)
+        value = value << 8 | entries[entry * entry_size + i];
+
+      entry_bytes += value * scale;
+      entry_frames += frames_per_entry;
+      entry++;
+    }
+
+    uint32_t position = (uint64_t) entry_bytes * 256 / bytes;
+    info->toc[percent] = position > 255 ? 255 : position;
+  }
+
+  info->has_toc = true;
+
+  return true;
+}
+
+bool mp3_parse(const uint8_t *data, size_t length, uint32_t data_offset, uint32_t file_size,
+               Mp3Info *info)
+{
+  memset(info, 0, sizeof(*info));
+
+  // Find the first frame header; padding or junk sometimes comes first.
+  FrameHeader header;
+  size_t start = 0;
+  while (start + 4 <= length && !parseHeader(data + start, &header))
+    start++;
+
+  if (start + 4 > length || data_offset + start >= file_size)
+    return false;
+
+  info->audio_start = data_offset + start;
+  info->audio_bytes = file_size - info->audio_start;
+
+  const uint8_t *frame = data + start;
+  size_t frame_length = length - start;
+  if (parseXing(frame, frame_length, header, info) || parseVbri(frame, frame_length, header, info))
+    return true;
+
+  // Constant bitrate
+  info->duration_ms = (uint64_t) info->audio_bytes * 8 / header.bitrate_kbps;
+
+  return true;
+}
+
+uint32_t mp3_offset(const Mp3Info &info, uint32_t seconds)
+{
+  uint32_t ms = seconds * 1000;
+  if (!info.duration_ms || ms >= info.duration_ms)
+    return info.audio_start + info.audio_bytes;
+
+  uint32_t position;
+  if (info.has_toc) {
+    // Interpolate between the entries either side, in 1/1000ths of a
+    // percent.
+    uint32_t scaled = (uint64_t) ms * 100000 / info.duration_ms;
+    uint8_t percent = scaled / 1000;
+    uint32_t before = info.toc[percent];
+    uint32_t after = percent < 99 ? info.toc[percent + 1] : 256;
+    uint32_t fraction = before * 1000 + (after - before) * (scaled % 1000);
+
+    position = (uint64_t) fraction * info.audio_bytes / (256 * 1000);
+  } else {
+    position = (uint64_t) ms * info.audio_bytes / info.duration_ms;
+  }
+
+  return info.audio_start + position;
+}
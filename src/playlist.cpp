@@ -0,0 +1,293 @@
+#include <playlist.h>
+
+#include <card.h>
+#include <display.h>
+#include <vs1053.h>
+
+#include <Arduino.h>
+#include <SD.h>
+
+/*
+ * Cache layout:
+ *   PlaylistHeader
+ *   for each playlist:
+ *     char name[13]
+ *     uint16_t song_count
+ *     uint16_t songs[song_count]
+ */
+const char *const playlistCacheFilename = "cache/playlists.bin";
+const uint32_t playlist_magic = 0x314C5350; // "PSL1"
+
+// Longer lines are reported as invalid rather than matched partially.
+const size_t max_line_length = 255;
+
+struct PlaylistHeader {
+  uint32_t magic;
+  uint32_t song_count;
+  uint32_t playlist_count;
+};
+
+struct Playlist {
+  char name[13];
+  std::vector<uint16_t> songs;
+};
+
+std::vector<Playlist> playlists;
+
+// Next root directory entry to look at while importing.
+static uint16_t next_entry;
+
+bool isPlaylist(const char *filename)
+{
+  // Short names truncate ".m3u8" to ".M3U".
+  const char *extension = strrchr(filename, '.');
+  return extension && !strcasecmp(extension, ".M3U");
+}
+
+// Song index of a playlist entry, or -1 with the reason in error.
+int resolveEntry(char *entry, const char **error)
+{
+  if (strstr(entry, "://")) {
+    *error = "not a file";
+    return -1;
+  }
+
+  // The library only has the root directory.
+  if (!strncmp(entry, "./", 2) || !strncmp(entry, ".\\", 2))
+    entry += 2;
+  else if (entry[0] == '/' || entry[0] == '\\')
+    entry++;
+
+  if (strchr(entry, '/') || strchr(entry, '\\')) {
+    *error = "not in the root directory";
+    return -1;
+  }
+
+  // Library filenames are 8.3 names, which are upper case.
+  for (char *c = entry; *c; c++)
+    *c = toupper(*c);
+
+  int song = vs1053_findSong(entry);
+  if (song < 0)
+    *error = "no such song";
+
+  return song;
+}
+
+// Add the song a line names, skipping comments, #EXTINF lines, and blanks.
+// Returns false if the line names something that isn't in the library.
+bool addEntry(Playlist *playlist, char *line, unsigned int line_number, bool truncated)
+{
+  // UTF-8 byte order mark
+  if (line_number == 1 && !strncmp(line, "\xEF\xBB\xBF", 3))
+    line += 3;
+
+  if (!line[0] || line[0] == '#')
+    return true;
+
+  const char *error = "line too long";
+  int song = truncated ? -1 : resolveEntry(line, &error);
+  if (song < 0) {
+    Serial.printf("%12s | line %u: %s: %s\r\n", playlist->name, line_number, error, line);
+    return false;
+  }
+
+  playlist->songs.push_back(song);
+  return true;
+}
+
+// Read the playlist a block at a time, adding the songs it names. Returns the
+// number of invalid entries.
+int parsePlaylist(File &file, Playlist *playlist)
+{
+  uint8_t buf[512];
+  char line[max_line_length + 1];
+  size_t length = 0;
+  bool truncated = false;
+  unsigned int line_number = 0;
+  int errors = 0;
+
+  int read;
+  while ((read = file.read(buf, sizeof(buf))) > 0) {
+    for (int i = 0; i < read; i++) {
+      char c = buf[i];
+      if (c == '\r')
+        continue;
+
+      if (c != '\n') {
+        if (length < max_line_length)
+          line[length++] = c;
+        else
+          truncated = true;
+
+        continue;
+      }
+
+      line[length] = '\0';
+      if (!addEntry(playlist, line, ++line_number, truncated))
+        errors++;
+
+      length = 0;
+      truncated = false;
+    }
+  }
+
+  // The last line might not end in a newline.
+  line[length] = '\0';
+  if ((length || truncated) && !addEntry(playlist, line, ++line_number, truncated))
+    errors++;
+
+  return errors;
+}
+
+bool writePlaylistCache()
+{
+  // Not FILE_WRITE: its O_APPEND would put the header written last at the
+  // end rather than over the placeholder.
+  auto cacheFile = SD.open(playlistCacheFilename, O_WRITE | O_CREAT | O_TRUNC);
+  if (!cacheFile) {
+    Serial.println("Failed to open playlist cache");
+    return false;
+  }
+
+  // Written last, so an interrupted write is detected as invalid.
+  PlaylistHeader header = {};
+  cacheFile.write((const uint8_t*) &header, sizeof(header));
+
+  for (auto &playlist : playlists) {
+    uint16_t song_count = playlist.songs.size();
+    cacheFile.write((const uint8_t*) playlist.name, sizeof(playlist.name));
+    cacheFile.write((const uint8_t*) &song_count, sizeof(song_count));
+    cacheFile.write((const uint8_t*) playlist.songs.data(), song_count * sizeof(uint16_t));
+  }
+
+  header.magic = playlist_magic;
+  header.song_count = vs1053_songCount();
+  header.playlist_count = playlists.size();
+  cacheFile.seek(0);
+  cacheFile.write((const uint8_t*) &header, sizeof(header));
+
+  cacheFile.close();
+
+  return true;
+}
+
+void playlist_beginImport()
+{
+  playlists.clear();
+  next_entry = 0;
+}
+
+bool playlist_importNext()
+{
+  char buf[64];
+
+  // Other card access moves the directory position between calls.
+  CardEntry entry;
+  card_rewind(next_entry);
+  do {
+    if (!card_nextFile(&entry)) {
+      writePlaylistCache();
+      return false;
+    }
+  } while (!isPlaylist(entry.name));
+
+  next_entry = entry.dir_index + 1;
+
+  auto file = card_open(entry.dir_index, entry.first_cluster, entry.name);
+  if (!file) {
+    Serial.printf("%12s | error - failed to open\r\n", entry.name);
+    return true;
+  }
+
+  Playlist playlist;
+  strcpy(playlist.name, entry.name);
+
+  int errors = parsePlaylist(file, &playlist);
+  file.close();
+
+  snprintf(buf, sizeof(buf), "Playlist %s", playlist.name);
+  if (errors)
+    snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), " | %d errors", errors);
+
+  display_text(buf, "Cache build");
+
+  Serial.printf("%12s | %u songs, %d invalid\r\n", playlist.name, playlist.songs.size(), errors);
+
+  if (playlist.songs.empty())
+    return true;
+
+  playlist.songs.shrink_to_fit();
+  playlists.push_back(std::move(playlist));
+
+  return true;
+}
+
+void playlist_import()
+{
+  playlist_beginImport();
+  while (playlist_importNext());
+}
+
+bool playlist_loadCache()
+{
+  playlists.clear();
+
+  auto cacheFile = SD.open(playlistCacheFilename, FILE_READ);
+  if (!cacheFile) {
+    Serial.println("Failed to open playlist cache");
+    return false;
+  }
+
+  PlaylistHeader header;
+  if (cacheFile.read((uint8_t*) &header, sizeof(header)) != sizeof(header) ||
+      header.magic != playlist_magic || header.song_count != (uint32_t) vs1053_songCount()) {
+    Serial.println("Playlist cache is invalid");
+    cacheFile.close();
+    return false;
+  }
+
+  for (uint32_t i = 0; i < header.playlist_count; i++) {
+    Playlist playlist;
+    uint16_t song_count;
+    if (cacheFile.read((uint8_t*) playlist.name, sizeof(playlist.name)) != sizeof(playlist.name) ||
+        cacheFile.read((uint8_t*) &song_count, sizeof(song_count)) != sizeof(song_count)) {
+      break;
+    }
+
+    playlist.name[sizeof(playlist.name) - 1] = '\0';
+    playlist.songs.resize(song_count);
+    size_t length = song_count * sizeof(uint16_t);
+    if ((size_t) cacheFile.read((uint8_t*) playlist.songs.data(), length) != length)
+      break;
+
+    playlists.push_back(std::move(playlist));
+  }
+
+  cacheFile.close();
+
+  if (playlists.size() != header.playlist_count) {
+    Serial.println("Playlist cache is truncated");
+    playlists.clear();
+    return false;
+  }
+
+  Serial.printf("%u playlists loaded from cache\r\n", playlists.size());
+
+  return true;
+}
+
+int playlist_count()
+{
+  return playlists.size();
+}
+
+const char *playlist_name(int playlist)
+{
+  return playlists[playlist].name;
+}
+
+const std::vector<uint16_t> &playlist_songs(int playlist)
+{
+  return playlists[playlist].songs;
+}
@@ -0,0 +1,407 @@
+#include <sci.h>
+
+#include <constants.h>
+#include <log.h>
+#include <Adafruit_VS1053.h>
+#include <Arduino.h>
+#include <SPI.h>
+
+// Clock multiplier is from a 12.288 MHz crystal.
+const uint32_t xtali_hz = 12288000;
+
+// Before the multiplier is known, the slowest it could be.
+const uint32_t initial_read_hz = 1000000;
+
+// Instruction memory is mapped from here in WRAMADDR.
+const uint16_t iram_start = 0x8000;
+const uint16_t iram_end = 0xC000;
+
+// Shorter runs, such as the two word hooks patches install, are always
+// written.
+const uint16_t min_skippable_run = 16;
+// Checksum of the plugin last loaded in full, in two words at the end of X
+// memory's application area, clear of the plugin's own variables. Cleared
+// while loading, so a load cut short isn't trusted.
+const uint16_t stamp_address = 0x187E;
+
+// Local decode time is corrected from the chip this often.
+const unsigned long decode_time_sync_ms = 2000;
+
+// Scratch words for sci_testClocks(), in X memory set aside for
+// applications. What's there is put back afterwards.
+const uint16_t test_address = 0x1800;
+const uint8_t test_words = 16;
+const uint8_t test_passes = 8;
+const uint16_t test_patterns[] = {0x0000, 0xFFFF, 0xAAAA, 0x5555, 0x0F0F, 0xF0F0, 0x00FF, 0xFF00};
+
+uint8_t cs;
+uint8_t dcs;
+static uint8_t dreq;
+
+uint32_t clki_hz;
+
+// Calibrated clocks, or 0 for the datasheet's.
+uint32_t calibrated_read_hz;
+uint32_t calibrated_write_hz;
+
+// Last value written to each register, for those marked valid.
+uint16_t shadow[16];
+uint16_t shadow_valid;
+
+uint32_t decode_time_ms;
+unsigned long decode_time_updated;
+unsigned long decode_time_synced;
+bool decode_time_synced_once = false;
+
+uint32_t transaction_count;
+uint32_t reported_transaction_count;
+unsigned long last_transaction_report;
+
+// The datasheet allows writes at up to CLKI/4 and reads at up to CLKI/7.
+SPISettings write_settings(initial_read_hz, MSBFIRST, SPI_MODE0);
+SPISettings read_settings(initial_read_hz, MSBFIRST, SPI_MODE0);
+
+void applyClocks();
+
+void waitForDreq()
+{
+  while (!digitalRead(dreq));
+}
+
+// One register write, inside a transaction.
+void writeRegister(uint8_t address, uint16_t value)
+{
+  transaction_count++;
+  shadow[address & 0xF] = value;
+  shadow_valid |= 1 << (address & 0xF);
+
+  digitalWrite(cs, LOW);
+  SPI.transfer(VS1053_SCI_WRITE);
+  SPI.transfer(address);
+  SPI.transfer(value >> 8);
+  SPI.transfer(value & 0xFF);
+  digitalWrite(cs, HIGH);
+}
+
+uint16_t readRegister(uint8_t address)
+{
+  transaction_count++;
+
+  digitalWrite(cs, LOW);
+  SPI.transfer(VS1053_SCI_READ);
+  SPI.transfer(address);
+  uint16_t value = SPI.transfer(0x00) << 8;
+  value |= SPI.transfer(0x00);
+  digitalWrite(cs, HIGH);
+
+  return value;
+}
+
+void sci_begin(uint8_t cs_pin, uint8_t dcs_pin, uint8_t dreq_pin)
+{
+  cs = cs_pin;
+  dcs = dcs_pin;
+  dreq = dreq_pin;
+
+  shadow_valid = 0;
+  decode_time_synced_once = false;
+
+  read_settings = SPISettings(initial_read_hz, MSBFIRST, SPI_MODE0);
+
+  // SC_MULT, the top 3 bits, is 1.0x then 2.0x to 5.0x in halves.
+  uint8_t multiplier = sci_read(VS1053_REG_CLOCKF) >> 13;
+  uint8_t doubled = multiplier ? multiplier + 3 : 2;
+  clki_hz = xtali_hz / 2 * doubled;
+
+  applyClocks();
+}
+
+void sci_limits(uint32_t *read_hz, uint32_t *write_hz)
+{
+  *read_hz = clki_hz / 7;
+  *write_hz = clki_hz / 4;
+}
+
+void applyClocks()
+{
+  // Calibrated clocks never go past the datasheet's.
+  uint32_t read_hz;
+  uint32_t write_hz;
+  sci_limits(&read_hz, &write_hz);
+  if (calibrated_read_hz)
+    read_hz = min(read_hz, calibrated_read_hz);
+  if (calibrated_write_hz)
+    write_hz = min(write_hz, calibrated_write_hz);
+
+  write_settings = SPISettings(write_hz, MSBFIRST, SPI_MODE0);
+  read_settings = SPISettings(read_hz, MSBFIRST, SPI_MODE0);
+
+  LOG_DEBUG("SCI: CLKI %lu kHz, writes at %lu kHz, reads at %lu kHz\r\n",
+            clki_hz / 1000, write_hz / 1000, read_hz / 1000);
+}
+
+void sci_setClocks(uint32_t read_hz, uint32_t write_hz)
+{
+  calibrated_read_hz = read_hz;
+  calibrated_write_hz = write_hz;
+
+  if (clki_hz)
+    applyClocks();
+}
+
+// Write the test words through WRAM and read them back.
+bool writeAndCheck(uint8_t pass)
+{
+  SPI.beginTransaction(write_settings);
+  writeRegister(VS1053_REG_WRAMADDR, test_address);
+  for (uint8_t i = 0; i < test_words; i++) {
+    waitForDreq();
+    writeRegister(VS1053_REG_WRAM, test_patterns[(i + pass) % COUNT_OF(test_patterns)] ^ (i << 8));
+  }
+  writeRegister(VS1053_REG_WRAMADDR, test_address);
+  SPI.endTransaction();
+
+  SPI.beginTransaction(read_settings);
+  bool matched = true;
+  for (uint8_t i = 0; i < test_words; i++) {
+    if (readRegister(VS1053_REG_WRAM) != (test_patterns[(i + pass) % COUNT_OF(test_patterns)] ^ (i << 8)))
+      matched = false;
+  }
+  SPI.endTransaction();
+
+  return matched;
+}
+
+bool sci_testClocks(uint32_t read_hz, uint32_t write_hz)
+{
+  SPISettings saved_write = write_settings;
+  SPISettings saved_read = read_settings;
+  SPISettings slow(initial_read_hz, MSBFIRST, SPI_MODE0);
+
+  write_settings = read_settings = slow;
+  uint16_t original[test_words];
+  sci_write(VS1053_REG_WRAMADDR, test_address);
+  for (uint8_t i = 0; i < test_words; i++)
+    original[i] = sci_read(VS1053_REG_WRAM);
+
+  // Each clock is checked against the slowest, so a failure is its own.
+  bool passed = true;
+  for (uint8_t pass = 0; pass < test_passes && passed; pass++) {
+    write_settings = SPISettings(write_hz, MSBFIRST, SPI_MODE0);
+    read_settings = slow;
+    passed = writeAndCheck(pass);
+
+    write_settings = slow;
+    read_settings = SPISettings(read_hz, MSBFIRST, SPI_MODE0);
+    passed = passed && writeAndCheck(pass);
+  }
+
+  write_settings = read_settings = slow;
+  sci_write(VS1053_REG_WRAMADDR, test_address);
+  for (uint8_t i = 0; i < test_words; i++)
+    sci_write(VS1053_REG_WRAM, original[i]);
+
+  write_settings = saved_write;
+  read_settings = saved_read;
+
+  return passed;
+}
+
+bool sci_check(uint8_t address)
+{
+  if (!(shadow_valid & (1 << (address & 0xF))))
+    return true;
+
+  return sci_read(address) == shadow[address & 0xF];
+}
+
+void sci_writeData(const uint8_t *data, uint8_t length)
+{
+  SPI.beginTransaction(write_settings);
+  digitalWrite(dcs, LOW);
+  for (uint8_t i = 0; i < length; i++)
+    SPI.transfer(data[i]);
+  digitalWrite(dcs, HIGH);
+  SPI.endTransaction();
+}
+
+void sci_write(uint8_t address, uint16_t value)
+{
+  SPI.beginTransaction(write_settings);
+  writeRegister(address, value);
+  SPI.endTransaction();
+}
+
+uint16_t sci_read(uint8_t address)
+{
+  SPI.beginTransaction(read_settings);
+  uint16_t value = readRegister(address);
+  SPI.endTransaction();
+
+  return value;
+}
+
+void sci_set(uint8_t address, uint16_t value)
+{
+  if ((shadow_valid & (1 << (address & 0xF))) && shadow[address & 0xF] == value)
+    return;
+
+  sci_write(address, value);
+}
+
+uint16_t sci_decodeTime(bool running)
+{
+  unsigned long now = millis();
+
+  if (running)
+    decode_time_ms += now - decode_time_updated;
+
+  decode_time_updated = now;
+
+  if (!decode_time_synced_once || now - decode_time_synced >= decode_time_sync_ms) {
+    uint16_t seconds = sci_read(VS1053_REG_DECODETIME);
+
+    // Keep the fraction of a second counted locally if it's still in the
+    // same second, so the time doesn't jitter.
+    if (decode_time_ms / 1000 != seconds)
+      decode_time_ms = (uint32_t) seconds * 1000;
+
+    decode_time_synced = now;
+    decode_time_synced_once = true;
+  }
+
+  return decode_time_ms / 1000;
+}
+
+void sci_setDecodeTime(uint16_t seconds)
+{
+  SPI.beginTransaction(write_settings);
+  writeRegister(VS1053_REG_DECODETIME, seconds);
+  writeRegister(VS1053_REG_DECODETIME, seconds);
+  SPI.endTransaction();
+
+  decode_time_ms = (uint32_t) seconds * 1000;
+  decode_time_updated = millis();
+  decode_time_synced = decode_time_updated;
+  decode_time_synced_once = true;
+}
+
+uint16_t sci_transactionsPerSecond()
+{
+  unsigned long now = millis();
+  unsigned long elapsed = max(now - last_transaction_report, 1ul);
+
+  uint16_t rate = (uint64_t) (transaction_count - reported_transaction_count) * 1000 / elapsed;
+
+  reported_transaction_count = transaction_count;
+  last_transaction_report = now;
+
+  return rate;
+}
+
+// Whether a WRAMADDR address is in instruction memory, where each 32 bit
+// word takes two writes.
+bool iram(uint16_t address)
+{
+  return address >= iram_start && address < iram_end;
+}
+
+// FNV-1a over the plugin, a byte at a time.
+uint32_t pluginChecksum(const uint16_t *plugin, uint16_t size)
+{
+  uint32_t hash = 2166136261u;
+  for (uint16_t i = 0; i < size; i++) {
+    hash = (hash ^ (plugin[i] & 0xFF)) * 16777619u;
+    hash = (hash ^ (plugin[i] >> 8)) * 16777619u;
+  }
+
+  return hash;
+}
+
+uint32_t readStamp()
+{
+  sci_write(VS1053_REG_WRAMADDR, stamp_address);
+  uint32_t stamp = sci_read(VS1053_REG_WRAM);
+  return stamp | (uint32_t) sci_read(VS1053_REG_WRAM) << 16;
+}
+
+void writeStamp(uint32_t stamp)
+{
+  sci_write(VS1053_REG_WRAMADDR, stamp_address);
+  sci_write(VS1053_REG_WRAM, stamp & 0xFFFF);
+  sci_write(VS1053_REG_WRAM, stamp >> 16);
+}
+
+// Records are an address and count, followed by count words to write to it,
+// or if the top bit of the count is set, one word to write count times.
+// Copies to WRAM go to the address last written to WRAMADDR.
+bool sci_loadPlugin(const uint16_t *plugin, uint16_t size)
+{
+  uint16_t wram_address = 0;
+  uint16_t skipped = 0;
+
+  // Instruction memory survives a soft reset, so if the stamp says this
+  // plugin was loaded, its instruction runs are still there.
+  uint32_t checksum = pluginChecksum(plugin, size);
+  bool resident = readStamp() == checksum;
+  if (!resident)
+    writeStamp(0);
+
+  uint16_t i = 0;
+  while (i + 2 <= size) {
+    uint8_t address = plugin[i];
+    uint16_t count = plugin[i + 1];
+    i += 2;
+
+    if (count & 0x8000) {
+      count &= 0x7FFF;
+      uint16_t value = plugin[i++];
+
+      // DREQ is low while the chip is busy with the last write.
+      SPI.beginTransaction(write_settings);
+      for (uint16_t j = 0; j < count; j++) {
+        waitForDreq();
+        writeRegister(address, value);
+      }
+      SPI.endTransaction();
+
+      if (address == VS1053_REG_WRAM)
+        wram_address += iram(wram_address) ? count / 2 : count;
+
+      continue;
+    }
+
+    const uint16_t *words = plugin + i;
+    i += count;
+
+    if (address == VS1053_REG_WRAMADDR && count == 1)
+      wram_address = words[0];
+
+    if (address == VS1053_REG_WRAM && resident && iram(wram_address) && count >= min_skippable_run &&
+        !(count & 1)) {
+      skipped += count;
+      wram_address += count / 2;
+
+      // Put WRAMADDR where the writes would have left it.
+      sci_write(VS1053_REG_WRAMADDR, wram_address);
+      continue;
+    }
+
+    SPI.beginTransaction(write_settings);
+    for (uint16_t j = 0; j < count; j++) {
+      waitForDreq();
+      writeRegister(address, words[j]);
+    }
+    SPI.endTransaction();
+
+    if (address == VS1053_REG_WRAM)
+      wram_address += iram(wram_address) ? count / 2 : count;
+  }
+
+  if (!resident)
+    writeStamp(checksum);
+
+  LOG_INFO("Plugin: %u of %u words already loaded\r\n", skipped, size);
+
+  return skipped > 0;
+}
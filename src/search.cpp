@@ -0,0 +1,440 @@
+#include <search.h>
+
+#include <constants.h>
+#include <cpu.h>
+#include <display.h>
+#include <io.h>
+#include <log.h>
+#include <vs1053.h>
+
+#include <Arduino.h>
+#include <SD.h>
+#include <algorithm>
+
+/*
+ * Index layout:
+ *   SearchHeader
+ *   uint32_t starts[bucket_count + 1] - where each bucket's postings begin
+ *   uint16_t postings[]               - song indices, ascending per bucket
+ *
+ * Trigrams are hashed into buckets, so a bucket's songs are only candidates;
+ * they're checked against the full query before being reported.
+ */
+const char *const searchIndexFilename = "cache/search.idx";
+const uint32_t search_magic = 0x31495254; // "TRI1"
+const uint16_t bucket_count = 4096;
+// Characters are folded into 37 symbols: space/punctuation, a-z, and 0-9.
+const uint32_t trigram_count = 37 * 37 * 37;
+
+// Postings held in RAM while writing the index, one range of buckets at a time.
+const size_t build_buffer_postings = 8192;
+// Postings read from a bucket at once.
+const size_t read_chunk_postings = 8192;
+
+struct SearchHeader {
+  uint32_t magic;
+  uint32_t song_count;
+  uint32_t names_hash;
+};
+
+const uint32_t starts_offset = sizeof(SearchHeader);
+const uint32_t postings_offset = starts_offset + (bucket_count + 1) * sizeof(uint32_t);
+
+std::vector<uint16_t> results;
+String previous_query;
+
+char foldCharacter(char c)
+{
+  if (c >= 'A' && c <= 'Z')
+    return c - 'A' + 'a';
+
+  if ((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9'))
+    return c;
+
+  return ' ';
+}
+
+uint8_t trigramSymbol(char c)
+{
+  c = foldCharacter(c);
+
+  if (c >= 'a' && c <= 'z')
+    return 1 + c - 'a';
+
+  if (c >= '0' && c <= '9')
+    return 27 + c - '0';
+
+  return 0;
+}
+
+uint16_t trigramBucket(uint32_t trigram)
+{
+  // Fibonacci hashing; keep the top 12 bits.
+  return (trigram * 2654435761u) >> 20;
+}
+
+// Distinct buckets of the trigrams in the text, sorted.
+void textBuckets(const char *text, std::vector<uint16_t> *buckets)
+{
+  buckets->clear();
+
+  uint32_t trigram = 0;
+  for (size_t i = 0; text[i]; i++) {
+    trigram = (trigram * 37 + trigramSymbol(text[i])) % trigram_count;
+    if (i >= 2)
+      buckets->push_back(trigramBucket(trigram));
+  }
+
+  std::sort(buckets->begin(), buckets->end());
+  buckets->erase(std::unique(buckets->begin(), buckets->end()), buckets->end());
+}
+
+bool containsFolded(const char *text, const char *query)
+{
+  for (; *text; text++) {
+    size_t i = 0;
+    while (query[i] && text[i] && foldCharacter(text[i]) == foldCharacter(query[i]))
+      i++;
+
+    if (!query[i])
+      return true;
+  }
+
+  return false;
+}
+
+// Add a song's name to the hash that detects an index left over from a
+// different library.
+uint32_t hashName(uint32_t hash, const char *name)
+{
+  // FNV-1a
+  for (const char *c = name; ; c++) {
+    hash = (hash ^ (uint8_t) *c) * 16777619u;
+    if (!*c)
+      break;
+  }
+
+  return hash;
+}
+
+// Whether the index on the card is for the library as it is now.
+bool indexCurrent(uint32_t names_hash)
+{
+  SearchHeader header = {};
+  auto indexFile = SD.open(searchIndexFilename, FILE_READ);
+  if (indexFile) {
+    indexFile.read(&header, sizeof(header));
+    indexFile.close();
+  }
+
+  return header.magic == search_magic && header.song_count == (uint32_t) vs1053_songCount() &&
+         header.names_hash == names_hash;
+}
+
+// A build goes a song at a time: hashing the names to see if the index on
+// the card is current, then counting postings per bucket, then a pass over
+// the names for each range of buckets whose postings fit in the buffer. A
+// single bucket too big for the buffer is written out in song order as it
+// fills.
+enum BuildStep {
+  build_hashing,
+  build_counting,
+  build_filling,
+  build_done,
+};
+
+static BuildStep build_step = build_done;
+static int build_song;
+static uint32_t build_hash;
+static unsigned long build_start;
+static File build_file;
+static std::vector<uint32_t> starts;
+static std::vector<uint16_t> postings;
+static std::vector<uint16_t> filled;
+// The range of buckets being filled, and postings waiting to be written.
+static uint16_t range_first;
+static uint16_t range_last;
+static size_t buffered;
+
+void endBuild()
+{
+  build_file.close();
+  build_step = build_done;
+
+  starts.clear();
+  starts.shrink_to_fit();
+  postings.clear();
+  postings.shrink_to_fit();
+  filled.clear();
+  filled.shrink_to_fit();
+}
+
+// Turn the counts into start positions, and write all but the header, which
+// is written last so an interrupted build is detected as invalid.
+bool beginFilling()
+{
+  for (uint16_t bucket = 0; bucket < bucket_count; bucket++)
+    starts[bucket + 1] += starts[bucket];
+
+  // Not FILE_WRITE: its O_APPEND would put the header written last at the
+  // end rather than over the placeholder.
+  build_file = SD.open(searchIndexFilename, O_WRITE | O_CREAT | O_TRUNC);
+  if (!build_file) {
+    Serial.println("Failed to open search index");
+    return false;
+  }
+
+  SearchHeader header = {};
+  build_file.write((const uint8_t*) &header, sizeof(header));
+  build_file.write((const uint8_t*) starts.data(), starts.size() * sizeof(uint32_t));
+
+  postings.resize(build_buffer_postings);
+  range_last = 0;
+
+  return true;
+}
+
+// Start on the range of buckets after the last, with as many whole buckets as
+// fit in the buffer. Returns false once they're all written.
+bool beginRange()
+{
+  range_first = range_last;
+  if (range_first == bucket_count)
+    return false;
+
+  range_last = range_first + 1;
+  while (range_last < bucket_count && starts[range_last + 1] - starts[range_first] <= build_buffer_postings)
+    range_last++;
+
+  filled.assign(range_last - range_first, 0);
+  buffered = 0;
+  build_song = 0;
+
+  return true;
+}
+
+void fillSong(int song, std::vector<uint16_t> *buckets)
+{
+  uint32_t base = starts[range_first];
+  uint32_t length = starts[range_last] - base;
+
+  for (auto bucket = std::lower_bound(buckets->begin(), buckets->end(), range_first);
+       bucket != buckets->end() && *bucket < range_last; bucket++) {
+    if (length <= build_buffer_postings) {
+      postings[starts[*bucket] - base + filled[*bucket - range_first]++] = song;
+      continue;
+    }
+
+    postings[buffered++] = song;
+    if (buffered == build_buffer_postings) {
+      build_file.write((const uint8_t*) postings.data(), buffered * sizeof(uint16_t));
+      buffered = 0;
+    }
+  }
+}
+
+void endRange()
+{
+  if (starts[range_last] - starts[range_first] <= build_buffer_postings)
+    buffered = starts[range_last] - starts[range_first];
+
+  build_file.write((const uint8_t*) postings.data(), buffered * sizeof(uint16_t));
+}
+
+void finishBuild()
+{
+  SearchHeader header;
+  header.magic = search_magic;
+  header.song_count = vs1053_songCount();
+  header.names_hash = build_hash;
+  build_file.seek(0);
+  build_file.write((const uint8_t*) &header, sizeof(header));
+  build_file.close();
+
+  Serial.printf("Search index: %lu entries\r\n", starts[bucket_count]);
+
+  if (!indexCurrent(build_hash))
+    Serial.println("Search index didn't read back after writing");
+
+  Serial.printf("Built search index in %lu ms\r\n", millis() - build_start);
+}
+
+void search_beginIndex()
+{
+  endBuild();
+
+  build_step = build_hashing;
+  build_song = 0;
+  build_hash = 2166136261u;
+  build_start = millis();
+}
+
+bool search_buildIndex()
+{
+  int song_count = vs1053_songCount();
+  std::vector<uint16_t> buckets;
+
+  switch (build_step) {
+  case build_hashing:
+    if (build_song < song_count) {
+      build_hash = hashName(build_hash, vs1053_songName(build_song++));
+      break;
+    }
+
+    if (indexCurrent(build_hash)) {
+      endBuild();
+      break;
+    }
+
+    starts.assign(bucket_count + 1, 0);
+    build_song = 0;
+    build_step = build_counting;
+    break;
+
+  case build_counting:
+    if (build_song < song_count) {
+      textBuckets(vs1053_songName(build_song++), &buckets);
+      for (auto bucket : buckets)
+        starts[bucket + 1]++;
+
+      break;
+    }
+
+    if (!beginFilling()) {
+      endBuild();
+      break;
+    }
+
+    beginRange();
+    build_step = build_filling;
+    break;
+
+  case build_filling:
+    if (build_song < song_count) {
+      textBuckets(vs1053_songName(build_song), &buckets);
+      fillSong(build_song++, &buckets);
+      break;
+    }
+
+    endRange();
+    if (!beginRange()) {
+      finishBuild();
+      endBuild();
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  return build_step != build_done;
+}
+
+void search_abortIndex()
+{
+  // The header is still the placeholder, so what's there reads as invalid.
+  endBuild();
+}
+
+void search_prepareIndex()
+{
+  search_beginIndex();
+
+  bool shown = false;
+  while (search_buildIndex()) {
+    if (!shown && build_step != build_hashing) {
+      display_text("Building search index", booting);
+      shown = true;
+    }
+  }
+}
+
+// Read the songs in the smallest bucket of the query's trigrams. Every match
+// is in all of them, so the smallest is the fewest to check.
+bool readCandidates(const char *query, std::vector<uint16_t> *candidates)
+{
+  std::vector<uint16_t> buckets;
+  textBuckets(query, &buckets);
+
+  auto indexFile = SD.open(searchIndexFilename, FILE_READ);
+  if (!indexFile)
+    return false;
+
+  uint32_t smallest[2] = {0, UINT32_MAX};
+  bool success = true;
+  for (auto bucket : buckets) {
+    uint32_t range[2];
+    success = indexFile.seek(starts_offset + bucket * sizeof(uint32_t)) &&
+              indexFile.read(range, sizeof(range)) == sizeof(range);
+    if (!success)
+      break;
+
+    if (range[1] - range[0] < smallest[1] - smallest[0]) {
+      smallest[0] = range[0];
+      smallest[1] = range[1];
+    }
+  }
+
+  if (success) {
+    candidates->resize(smallest[1] - smallest[0]);
+    success = indexFile.seek(postings_offset + smallest[0] * sizeof(uint16_t));
+  }
+
+  // File::read() takes a 16 bit length, which a big library's bucket can
+  // outgrow.
+  for (size_t done = 0; success && done < candidates->size(); done += read_chunk_postings) {
+    size_t length = min(read_chunk_postings, candidates->size() - done) * sizeof(uint16_t);
+    success = (size_t) indexFile.read(candidates->data() + done, length) == length;
+  }
+
+  indexFile.close();
+
+  return success;
+}
+
+void search_query(const char *query)
+{
+  unsigned long start = cpu_micros();
+
+  bool narrowing = previous_query.length() >= search_min_query &&
+                   !strncmp(query, previous_query.c_str(), previous_query.length());
+  previous_query = query;
+
+  if (strlen(query) < search_min_query) {
+    results.clear();
+    return;
+  }
+
+  if (!narrowing) {
+    io_begin(io_interactive);
+    bool read = readCandidates(query, &results);
+    io_end(io_interactive);
+
+    if (!read) {
+      Serial.println("Failed to read search index");
+      results.clear();
+      return;
+    }
+  }
+
+  // While the library is importing, the index can be from a larger one.
+  int song_count = vs1053_songCount();
+  auto unmatched = std::remove_if(results.begin(), results.end(), [query, song_count](uint16_t song) {
+    return song >= song_count || !containsFolded(vs1053_songName(song), query);
+  });
+  results.erase(unmatched, results.end());
+
+  LOG_INFO("Search '%s': %u results in %lu us\r\n", query, results.size(), cpu_micros() - start);
+}
+
+const std::vector<uint16_t> &search_results()
+{
+  return results;
+}
+
+void search_end()
+{
+  results.clear();
+  results.shrink_to_fit();
+  previous_query = "";
+}
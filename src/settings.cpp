@@ -0,0 +1,73 @@
+#include <settings.h>
+
+#include <Arduino.h>
+#include <SD.h>
+
+// One "key value" pair per line. Unknown keys are ignored, so settings files
+// from other versions still load.
+const char *const settingsFilename = "settings.txt";
+
+Settings settings = {
+  .shuffle = false,
+  .shuffle_seed = 0,
+  .card_spi_hz = 0,
+  .sci_read_hz = 0,
+  .sci_write_hz = 0,
+};
+
+bool settings_load()
+{
+  auto settingsFile = SD.open(settingsFilename, FILE_READ);
+  if (!settingsFile) {
+    Serial.println("No settings file; using defaults");
+    return false;
+  }
+
+  while (settingsFile.available()) {
+    auto line = settingsFile.readStringUntil('\n');
+
+    char key[16];
+    unsigned long value;
+    if (sscanf(line.c_str(), "%15s %lu", key, &value) != 2)
+      continue;
+
+    if (!strcmp(key, "shuffle"))
+      settings.shuffle = value;
+    else if (!strcmp(key, "shuffle_seed"))
+      settings.shuffle_seed = value;
+    else if (!strcmp(key, "card_spi_hz"))
+      settings.card_spi_hz = value;
+    else if (!strcmp(key, "sci_read_hz"))
+      settings.sci_read_hz = value;
+    else if (!strcmp(key, "sci_write_hz"))
+      settings.sci_write_hz = value;
+  }
+
+  settingsFile.close();
+
+  Serial.printf("Settings: shuffle %d seed %lu\r\n", settings.shuffle, settings.shuffle_seed);
+
+  return true;
+}
+
+bool settings_save()
+{
+  // FILE_WRITE appends, so start over.
+  SD.remove(settingsFilename);
+
+  auto settingsFile = SD.open(settingsFilename, FILE_WRITE);
+  if (!settingsFile) {
+    Serial.println("Failed to open settings file");
+    return false;
+  }
+
+  settingsFile.printf("shuffle %d\n", settings.shuffle);
+  settingsFile.printf("shuffle_seed %lu\n", settings.shuffle_seed);
+  settingsFile.printf("card_spi_hz %lu\n", settings.card_spi_hz);
+  settingsFile.printf("sci_read_hz %lu\n", settings.sci_read_hz);
+  settingsFile.printf("sci_write_hz %lu\n", settings.sci_write_hz);
+
+  settingsFile.close();
+
+  return true;
+}
@@ -0,0 +1,91 @@
+#include <shuffle.h>
+
+/*
+ * A small Feistel network is a bijection over 2^(2 * half_bits) values for
+ * any round function. Values at or beyond count are encrypted again until
+ * they land in range ("cycle walking"), which keeps it a bijection over
+ * [0, count). The domain is under 4 times count, so that takes a few rounds
+ * at most on average.
+ */
+const uint8_t feistel_rounds = 4;
+
+uint32_t roundFunction(uint32_t half, uint32_t seed, uint8_t round)
+{
+  uint32_t x = half ^ (seed + round * 0x9E3779B9u);
+
+  // Integer hash finalizer, so neighbouring values scatter.
+  x ^= x >> 16;
+  x *= 0x7FEB352Du;
+  x ^= x >> 15;
+  x *= 0x846CA68Bu;
+  x ^= x >> 16;
+
+  return x;
+}
+
+uint8_t halfBits(uint16_t count)
+{
+  uint8_t half_bits = 1;
+  while ((1u << (2 * half_bits)) < count)
+    half_bits++;
+
+  return half_bits;
+}
+
+uint32_t encrypt(uint32_t x, uint8_t half_bits, uint32_t seed)
+{
+  uint32_t mask = (1u << half_bits) - 1;
+  uint32_t left = x >> half_bits;
+  uint32_t right = x & mask;
+
+  for (uint8_t round = 0; round < feistel_rounds; round++) {
+    uint32_t next = left ^ (roundFunction(right, seed, round) & mask);
+    left = right;
+    right = next;
+  }
+
+  return (left << half_bits) | right;
+}
+
+uint32_t decrypt(uint32_t x, uint8_t half_bits, uint32_t seed)
+{
+  uint32_t mask = (1u << half_bits) - 1;
+  uint32_t left = x >> half_bits;
+  uint32_t right = x & mask;
+
+  for (uint8_t round = feistel_rounds; round > 0; round--) {
+    uint32_t previous = right ^ (roundFunction(left, seed, round - 1) & mask);
+    right = left;
+    left = previous;
+  }
+
+  return (left << half_bits) | right;
+}
+
+uint16_t shuffle_song(uint16_t position, uint16_t count, uint32_t seed)
+{
+  if (count < 2 || position >= count)
+    return position;
+
+  uint8_t half_bits = halfBits(count);
+  uint32_t x = position;
+  do {
+    x = encrypt(x, half_bits, seed);
+  } while (x >= count);
+
+  return x;
+}
+
+uint16_t shuffle_position(uint16_t song, uint16_t count, uint32_t seed)
+{
+  if (count < 2 || song >= count)
+    return song;
+
+  uint8_t half_bits = halfBits(count);
+  uint32_t x = song;
+  do {
+    x = decrypt(x, half_bits, seed);
+  } while (x >= count);
+
+  return x;
+}
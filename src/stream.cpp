@@ -0,0 +1,535 @@
+#include <stream.h>
+
+#include <card.h>
+#include <cpu.h>
+#include <latency.h>
+#include <log.h>
+#include <mp3.h>
+#include <sci.h>
+
+#include <Arduino.h>
+#include <SD.h>
+#include <SPI.h>
+#include <algorithm>
+#include <vector>
+
+const uint16_t block_size = 512;
+
+// Files more fragmented than this stream through the SD library instead.
+const size_t max_extents = 256;
+
+const uint16_t decode_mode = VS1053_MODE_SM_LINE1 | VS1053_MODE_SM_SDINEW | VS1053_MODE_SM_LAYER12;
+
+// Where the decoder keeps the byte to pad the end of a stream with.
+const uint16_t end_fill_byte_address = 0x1e06;
+// The datasheet says to reset if cancelling takes more than this much data.
+const uint16_t max_cancel_bytes = 2048;
+// endFillByte sent after a cancel, so the next stream starts clean.
+const uint16_t end_fill_bytes = 2052;
+const unsigned long dreq_timeout_ms = 100;
+
+struct Track {
+  char name[13];
+  uint32_t first_cluster;
+  uint32_t size;
+  // Open to validate the directory entry, and read from when the file
+  // couldn't be mapped.
+  File file;
+  std::vector<CardExtent> extents;
+  // Set when the track starts, for MP3s whose first frame could be parsed.
+  bool seekable;
+  Mp3Info mp3;
+};
+
+Adafruit_VS1053 *player;
+static uint8_t dreq;
+
+Track tracks[2];
+Track *current = &tracks[0];
+Track *prepared = &tracks[1];
+
+volatile bool playing = false;
+volatile bool stream_paused = false;
+
+// The block being sent, and where the next one comes from.
+uint8_t block[block_size];
+uint16_t block_offset;
+uint16_t block_length;
+volatile uint32_t read_position;
+
+// Blocks read ahead by stream_refill() from loop(), so the interrupt only
+// reads the card itself when they run out, and only for a mapped track. The
+// interrupt takes from the head, and loop() adds at the tail, only ever
+// writing slots past the end.
+const uint8_t ring_blocks = 16;
+
+struct RingBlock {
+  uint8_t data[block_size];
+  uint16_t offset;
+  uint16_t length;
+};
+
+static RingBlock ring[ring_blocks];
+volatile uint8_t ring_head;
+volatile uint8_t ring_count;
+// Bytes in the ring not yet sent.
+volatile uint32_t ring_bytes;
+
+// Fewest blocks left in the ring, and reads the interrupt had to make itself,
+// since the last stream_bufferStats().
+volatile uint8_t ring_lowest = ring_blocks;
+volatile uint32_t direct_reads;
+
+// The interrupt and loop() each keep their own place in the extent map.
+ExtentCursor feed_cursor;
+ExtentCursor refill_cursor;
+
+void feed();
+
+bool stream_begin(Adafruit_VS1053 *vs1053, uint8_t dreq_pin)
+{
+  player = vs1053;
+  dreq = dreq_pin;
+
+  int interrupt = digitalPinToInterrupt(dreq);
+  if (interrupt == NOT_AN_INTERRUPT)
+    return false;
+
+  // Hold off the feeder while anything else is using the bus.
+  SPI.usingInterrupt(interrupt);
+  attachInterrupt(interrupt, feed, CHANGE);
+
+  return true;
+}
+
+// Read a block of the playing track. length is less than a whole block only
+// at the end of the file.
+bool readTrackBlock(uint32_t file_block, uint8_t *dst, uint16_t length, ExtentCursor *cursor = &feed_cursor)
+{
+  if (current->extents.empty()) {
+    if (!current->file.seek(file_block * block_size) || current->file.read(dst, length) != length)
+      return false;
+  } else {
+    uint32_t first_cluster;
+    uint32_t block_offset;
+    if (!extents_locate(current->extents, card_blocksPerCluster(), file_block, cursor, &first_cluster,
+                        &block_offset))
+      return false;
+
+    if (!card_readBlock(card_clusterBlock(first_cluster) + block_offset, dst))
+      return false;
+  }
+
+  return true;
+}
+
+// Empty the ring, and start reading from position.
+void resetRing(uint32_t position)
+{
+  ring_head = 0;
+  ring_count = 0;
+  ring_bytes = 0;
+  read_position = position;
+  feed_cursor = refill_cursor = ExtentCursor{};
+  block_offset = block_length = 0;
+}
+
+// Put the next block to send in the buffer: from the ring if there is one,
+// or else from the card at read_position. Called with interrupts disabled.
+bool fill()
+{
+  if (ring_count) {
+    RingBlock &next = ring[ring_head];
+    memcpy(block, next.data, next.length);
+    block_offset = next.offset;
+    block_length = next.length;
+
+    ring_head = (ring_head + 1) % ring_blocks;
+    ring_count--;
+    ring_bytes -= next.length - next.offset;
+    ring_lowest = min(ring_lowest, ring_count);
+
+    return true;
+  }
+
+  if (read_position >= current->size)
+    return false;
+
+  if (playing)
+    direct_reads++;
+
+  uint16_t skip = read_position % block_size;
+  uint16_t length = min((uint32_t) block_size, current->size - read_position + skip);
+
+  if (!readTrackBlock(read_position / block_size, block, length))
+    return false;
+
+  block_offset = skip;
+  block_length = length;
+  read_position += length - skip;
+
+  return true;
+}
+
+// Send data for as long as the decoder wants it. Called from the DREQ
+// interrupt, and with interrupts disabled otherwise.
+void feed()
+{
+  if (!playing || stream_paused)
+    return;
+
+  while (player->readyForData()) {
+    // An unmapped track would read through the SD library's shared block
+    // cache, which loop() may be in the middle of using. Only loop() reads
+    // it, into the ring, so wait for stream_refill().
+    if (block_offset == block_length && !ring_count && current->extents.empty() &&
+        read_position < current->size) {
+      return;
+    }
+
+    if (block_offset == block_length && !fill()) {
+      // End of the track, or a read error; either way it's over.
+      playing = false;
+      return;
+    }
+
+    uint8_t length = min(block_length - block_offset, VS1053_DATABUFFERLEN);
+    sci_writeData(block + block_offset, length);
+    block_offset += length;
+
+    latency_mark(latency_fed);
+  }
+}
+
+uint8_t stream_refill()
+{
+  uint8_t read = 0;
+  while (true) {
+    noInterrupts();
+    bool room = playing && ring_count < ring_blocks && read_position < current->size;
+    uint32_t position = read_position;
+    RingBlock &next = ring[(ring_head + ring_count) % ring_blocks];
+    interrupts();
+
+    if (!room)
+      break;
+
+    uint16_t skip = position % block_size;
+    uint16_t length = min((uint32_t) block_size, current->size - position + skip);
+    if (!readTrackBlock(position / block_size, next.data, length, &refill_cursor))
+      break;
+
+    // Only add it if the interrupt didn't run out and read it first.
+    noInterrupts();
+    bool added = playing && read_position == position;
+    if (added) {
+      next.offset = skip;
+      next.length = length;
+      read_position += length - skip;
+      ring_bytes += length - skip;
+      ring_count++;
+    }
+    interrupts();
+
+    if (!added)
+      break;
+
+    read++;
+  }
+
+  // Fill the decoder's buffer too, as the interrupt would on its next edge.
+  noInterrupts();
+  feed();
+  interrupts();
+
+  return read;
+}
+
+void stream_bufferStats(uint8_t *lowest_blocks, uint32_t *interrupt_reads)
+{
+  noInterrupts();
+  *lowest_blocks = ring_lowest;
+  *interrupt_reads = direct_reads;
+  ring_lowest = ring_count;
+  direct_reads = 0;
+  interrupts();
+}
+
+void closeTrack(Track *track)
+{
+  track->file.close();
+  track->extents.clear();
+  track->name[0] = '\0';
+  track->seekable = false;
+}
+
+// Parse the frame headers of the playing track, starting from where its
+// audio does. Only the block holding that, and the next for a long header,
+// are read.
+void readMp3Info(uint32_t audio_start)
+{
+  uint8_t data[2 * block_size];
+  uint32_t first_block = audio_start / block_size;
+
+  size_t length = 0;
+  for (uint8_t i = 0; i < 2; i++) {
+    uint32_t position = (first_block + i) * block_size;
+    if (position >= current->size)
+      break;
+
+    uint16_t block_length = min((uint32_t) block_size, current->size - position);
+    if (!readTrackBlock(first_block + i, data + length, block_length))
+      break;
+
+    length += block_length;
+  }
+
+  uint16_t skip = audio_start % block_size;
+  if (length <= skip)
+    return;
+
+  current->seekable = mp3_parse(data + skip, length - skip, audio_start, current->size, &current->mp3);
+  if (current->seekable) {
+    LOG_DEBUG("%s: %lu s, %s\r\n", current->name, current->mp3.duration_ms / 1000,
+              current->mp3.has_toc ? "seek table" : "constant bitrate");
+  }
+}
+
+bool stream_prepare(const char *filename, uint16_t dir_index, uint32_t first_cluster)
+{
+  if (prepared->file && !strcmp(prepared->name, filename) && prepared->first_cluster == first_cluster)
+    return true;
+
+  unsigned long start = cpu_micros();
+
+  closeTrack(prepared);
+
+  // Open directly from the directory entry recorded at import, and fall back
+  // to searching by name if the card changed since.
+  bool mapped = false;
+  prepared->file = card_open(dir_index, first_cluster, filename);
+  if (prepared->file) {
+    mapped = card_extents(first_cluster, prepared->file.size(), &prepared->extents, max_extents);
+    if (!mapped)
+      prepared->extents.clear();
+  } else {
+    prepared->file = SD.open(filename);
+    if (!prepared->file)
+      return false;
+  }
+
+  strncpy(prepared->name, filename, sizeof(prepared->name) - 1);
+  prepared->name[sizeof(prepared->name) - 1] = '\0';
+  prepared->first_cluster = first_cluster;
+  prepared->size = prepared->file.size();
+
+  LOG_INFO("Prepared %s in %lu us: %u extents%s\r\n", filename, cpu_micros() - start,
+           prepared->extents.size(), mapped ? "" : " (unmapped; reading by file)");
+
+  return true;
+}
+
+bool stream_preparedMapped()
+{
+  return prepared->file && !prepared->extents.empty();
+}
+
+bool stream_start(uint32_t offset, uint16_t seconds)
+{
+  playing = false;
+  stream_paused = false;
+
+  std::swap(current, prepared);
+  closeTrack(prepared);
+
+  // Not sci_set: the chip clears SM_CANCEL by itself, so the cached value
+  // can't be trusted.
+  sci_write(VS1053_REG_MODE, decode_mode);
+  // Resync
+  sci_write(VS1053_REG_WRAMADDR, 0x1e29);
+  sci_write(VS1053_REG_WRAM, 0);
+
+  resetRing(0);
+
+  // Where the audio starts, for seeking.
+  if (!fill())
+    return false;
+
+  uint32_t audio_start = mp3_id3Length(block, block_length);
+  if (Adafruit_VS1053_FilePlayer::isMP3File(current->name))
+    readMp3Info(audio_start);
+
+  if (!offset)
+    offset = audio_start;
+
+  // Start sending from the offset, reusing the first block if it's in it.
+  if (offset >= read_position || offset < read_position - block_length) {
+    read_position = offset;
+    if (!fill())
+      return false;
+  } else {
+    block_offset = offset % block_size;
+  }
+
+  sci_setDecodeTime(seconds);
+
+  latency_mark(latency_started);
+
+  // Don't let the interrupt feed at the same time.
+  noInterrupts();
+  playing = true;
+  feed();
+  interrupts();
+
+  return true;
+}
+
+bool stream_seek(uint16_t seconds)
+{
+  if (!current->seekable)
+    return false;
+
+  // Hold off the feeder while the position moves.
+  noInterrupts();
+  bool was_playing = playing;
+  playing = false;
+  interrupts();
+
+  if (!was_playing)
+    return false;
+
+  resetRing(mp3_offset(current->mp3, seconds));
+
+  // The decoder finds the next frame header by itself.
+  if (!fill())
+    return false;
+
+  sci_setDecodeTime(seconds);
+
+  noInterrupts();
+  playing = true;
+  feed();
+  interrupts();
+
+  return true;
+}
+
+uint16_t stream_duration()
+{
+  return current->seekable ? current->mp3.duration_ms / 1000 : 0;
+}
+
+// Send data once the decoder wants it. Returns false if it doesn't in time.
+bool sendWhenReady(const uint8_t *data, uint8_t length)
+{
+  unsigned long wait_start = millis();
+  while (!player->readyForData()) {
+    if (millis() - wait_start > dreq_timeout_ms)
+      return false;
+  }
+
+  sci_writeData(data, length);
+  return true;
+}
+
+// Copy the next of the track's data to send, or zeros once it's run out.
+uint8_t nextTrackData(uint8_t *chunk)
+{
+  if (block_offset == block_length && !fill()) {
+    memset(chunk, 0, VS1053_DATABUFFERLEN);
+    return VS1053_DATABUFFERLEN;
+  }
+
+  uint8_t length = min(block_length - block_offset, VS1053_DATABUFFERLEN);
+  memcpy(chunk, block + block_offset, length);
+  block_offset += length;
+
+  return length;
+}
+
+// Cancel decoding as the datasheet describes: set SM_CANCEL and keep sending
+// the track, checking every 32 bytes until the decoder clears it. Then read
+// endFillByte, which is only valid once it has, and send 2052 bytes of it so
+// HDAT0 and HDAT1 read zero before the next track.
+bool cancelDecoding()
+{
+  sci_write(VS1053_REG_MODE, decode_mode | VS1053_MODE_SM_CANCEL);
+
+  uint8_t chunk[VS1053_DATABUFFERLEN];
+  bool cancelled = false;
+  for (uint16_t sent = 0; sent <= max_cancel_bytes; ) {
+    if (!(sci_read(VS1053_REG_MODE) & VS1053_MODE_SM_CANCEL)) {
+      cancelled = true;
+      break;
+    }
+
+    uint8_t length = nextTrackData(chunk);
+    if (!sendWhenReady(chunk, length))
+      return false;
+
+    sent += length;
+  }
+
+  if (!cancelled)
+    return false;
+
+  sci_write(VS1053_REG_WRAMADDR, end_fill_byte_address);
+  memset(chunk, sci_read(VS1053_REG_WRAM) & 0xFF, sizeof(chunk));
+
+  for (uint16_t sent = 0; sent < end_fill_bytes; ) {
+    uint8_t length = min((uint16_t) (end_fill_bytes - sent), (uint16_t) sizeof(chunk));
+    if (!sendWhenReady(chunk, length))
+      return false;
+
+    sent += length;
+  }
+
+  return true;
+}
+
+bool stream_stop()
+{
+  noInterrupts();
+  playing = false;
+  interrupts();
+
+  bool cancelled = cancelDecoding();
+
+  closeTrack(current);
+
+  return cancelled;
+}
+
+void stream_close()
+{
+  // Nothing is going to play, so it doesn't matter whether the cancel
+  // finished.
+  stream_stop();
+  closeTrack(prepared);
+}
+
+void stream_pause(bool pause)
+{
+  stream_paused = pause;
+
+  // DREQ is likely already high, so there won't be an edge to start feeding.
+  if (!pause) {
+    noInterrupts();
+    feed();
+    interrupts();
+  }
+}
+
+bool stream_playing()
+{
+  return playing;
+}
+
+uint32_t stream_position()
+{
+  noInterrupts();
+  uint32_t position = read_position - ring_bytes - (block_length - block_offset);
+  interrupts();
+
+  return position;
+}
@@ -0,0 +1,221 @@
+#include <ui.h>
+
+#include <display.h>
+#include <encoder.h>
+#include <playlist.h>
+#include <search.h>
+#include <vs1053.h>
+
+#include <Arduino.h>
+
+// A long press moves to the next mode.
+enum UiMode {
+  // Turning browses songs; pressing pauses.
+  mode_play,
+  // Turning jumps between groups of songs by first letter; pressing returns
+  // to play mode.
+  mode_jump,
+  // Turning picks a character; pressing adds it to the query, or deletes one,
+  // or plays the first match.
+  mode_search,
+  // Turning browses as in play mode; pressing turns shuffle on or off.
+  mode_shuffle,
+  // Turning picks a playlist; pressing plays it.
+  mode_playlist,
+  mode_count,
+};
+
+UiMode mode = mode_play;
+bool playback_paused = false;
+
+const char search_delete = '<';
+const char search_play = '>';
+const char search_wheel[] = " abcdefghijklmnopqrstuvwxyz0123456789<>";
+const int search_wheel_size = sizeof(search_wheel) - 1;
+const size_t max_query_length = 24;
+
+char search_text[max_query_length + 1];
+int search_wheel_position = 1;
+
+// Playlist under the cursor in playlist mode, or -1 for all songs.
+int playlist_choice = -1;
+
+void setPaused(bool paused)
+{
+  playback_paused = paused;
+  encoder_showPaused(playback_paused);
+  vs1053_pause(playback_paused);
+}
+
+void searchPress()
+{
+  size_t length = strlen(search_text);
+  char selected = search_wheel[search_wheel_position];
+
+  if (selected == search_play) {
+    auto &results = search_results();
+    if (results.empty())
+      return;
+
+    if (playback_paused)
+      setPaused(false);
+
+    vs1053_play(results[0]);
+    search_end();
+    mode = mode_play;
+    return;
+  }
+
+  if (selected == search_delete) {
+    if (length)
+      search_text[length - 1] = '\0';
+  } else if (length < max_query_length) {
+    search_text[length] = selected;
+    search_text[length + 1] = '\0';
+  }
+
+  search_query(search_text);
+}
+
+bool searchDisplay()
+{
+  char top[128];
+  char bottom[32];
+
+  auto &results = search_results();
+  if (strlen(search_text) < search_min_query)
+    snprintf(top, sizeof(top), "Search: turn and press to type");
+  else if (results.empty())
+    snprintf(top, sizeof(top), "No matches");
+  else
+    snprintf(top, sizeof(top), "%u: %s", results.size(), vs1053_songName(results[0]));
+
+  // Show the end of the query, and the character under the wheel.
+  const char *tail = search_text + max(0, (int) strlen(search_text) - 6);
+  char selected = search_wheel[search_wheel_position];
+  if (selected == search_play)
+    snprintf(bottom, sizeof(bottom), "%s [play]", tail);
+  else if (selected == search_delete)
+    snprintf(bottom, sizeof(bottom), "%s [del]", tail);
+  else
+    snprintf(bottom, sizeof(bottom), "%s[%c]", tail, selected);
+
+  return display_text(top, bottom);
+}
+
+void handlePress(EncoderPress press)
+{
+  if (press == press_long) {
+    if (mode == mode_search)
+      search_end();
+
+    mode = (UiMode) ((mode + 1) % mode_count);
+
+    if (mode == mode_search)
+      search_text[0] = '\0';
+
+    if (mode == mode_playlist)
+      playlist_choice = vs1053_playlist();
+
+    return;
+  }
+
+  switch (mode) {
+  case mode_play:
+    setPaused(!playback_paused);
+    break;
+  case mode_search:
+    searchPress();
+    break;
+  case mode_shuffle:
+    vs1053_setShuffle(!vs1053_shuffle());
+    break;
+  case mode_playlist:
+    if (playback_paused)
+      setPaused(false);
+
+    vs1053_selectPlaylist(playlist_choice);
+    mode = mode_play;
+    break;
+  default:
+    mode = mode_play;
+    break;
+  }
+}
+
+// Seconds moved per detent turned while holding the button down.
+const int seek_step_seconds = 10;
+
+void handleTurn(int change)
+{
+  // Turning while held seeks within the song, in any mode that plays.
+  if (encoder_held() && mode != mode_search && mode != mode_playlist) {
+    if (!playback_paused)
+      vs1053_seek(change * seek_step_seconds);
+
+    return;
+  }
+
+  // Searching doesn't change the song until a result is picked.
+  if (mode == mode_search) {
+    search_wheel_position = ((search_wheel_position + change) % search_wheel_size + search_wheel_size) % search_wheel_size;
+    return;
+  }
+
+  // All songs, then each playlist.
+  if (mode == mode_playlist) {
+    int choices = playlist_count() + 1;
+    playlist_choice = ((playlist_choice + 1 + change) % choices + choices) % choices - 1;
+    return;
+  }
+
+  if (playback_paused)
+    return;
+
+  switch (mode) {
+  case mode_play:
+  case mode_shuffle:
+    vs1053_browse(change);
+    break;
+  case mode_jump:
+    vs1053_jump(change);
+    break;
+  default:
+    break;
+  }
+}
+
+bool ui_loop()
+{
+  // Ignore encoder movement while the knob switch is changing - the position
+  // can become unstable.
+  auto press = encoder_getPress();
+  if (press != press_none) {
+    handlePress(press);
+  } else {
+    auto change = encoder_getChange(mode == mode_play);
+    if (change != 0)
+      handleTurn(change);
+  }
+
+  vs1053_loop();
+
+  if (mode == mode_search)
+    return searchDisplay();
+
+  if (mode == mode_jump) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "Jump: %c", vs1053_jumpGroup());
+    return vs1053_display(buf);
+  }
+
+  if (mode == mode_playlist) {
+    return display_text(playlist_choice < 0 ? "All songs" : playlist_name(playlist_choice),
+                        playlist_choice == vs1053_playlist() ? "Playlist: playing" : "Playlist");
+  }
+
+  if (mode == mode_shuffle)
+    return vs1053_display(vs1053_shuffle() ? "Shuffle: on" : "Shuffle: off");
+
+  return vs1053_display();
+}
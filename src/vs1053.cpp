@@ -1,9 +1,23 @@
 #include <vs1053.h>
 
+#include <boot.h>
+#include <card.h>
 #include <constants.h>
+#include <cpu.h>
 #include <display.h>
+#include <io.h>
+#include <journal.h>
+#include <latency.h>
 #include <led.h>
+#include <log.h>
+#include <mp3.h>
 #include <patching.h>
+#include <playlist.h>
+#include <sci.h>
+#include <search.h>
+#include <settings.h>
+#include <shuffle.h>
+#include <stream.h>
 
 #define MP3_ID3_TAGS_IMPLEMENTATION
 #include <mp3_id3_tags.h>
@@ -33,7 +47,24 @@ const uint8_t max_volume = 0;
 
 const uint8_t VS1053_RESET = -1;     // VS1053 reset pin (not used!)
 
+const char *const cacheDirectory = "cache";
 const char *const cacheFilename = "cache/cache.txt";
+// The cache is written here and renamed over the old one once it's complete.
+const char *const cacheTempName = "CACHE.TMP";
+const char *const cacheName = "CACHE.TXT";
+// First line of the cache. Change it when the format changes so old caches
+// are rebuilt instead of misread.
+const char *const cacheVersion = "4";
+// The last line is '#' and the FNV-1a hash of everything before it in hex.
+const uint8_t cache_trailer_length = 10;
+
+// A background import writes songs to the partial list in chunks, in the
+// cache's format, and then the checkpoint saying how far it's got, so a
+// reset can carry on from there.
+const char *const partialFilename = "cache/partial.txt";
+const char *const checkpointFilename = "cache/import.bin";
+const uint32_t checkpoint_magic = 0x31504D49; // "IMP1"
+const size_t checkpoint_songs = 32;
 
 // Feather ESP8266
 #if defined(ESP8266)
@@ -77,6 +108,12 @@ const uint8_t volume_pin = A2;
 struct Song {
   String filename;
   String displayName;
+  // Directory entry and first cluster, so the file opens without a
+  // directory search.
+  uint16_t dirIndex;
+  uint32_t firstCluster;
+  // Seconds, or 0 if unknown.
+  uint16_t duration;
 };
 
 Adafruit_VS1053_FilePlayer musicPlayer =
@@ -94,9 +131,135 @@ unsigned long song_start_millis;
 unsigned long song_millis_paused;
 bool paused = false;
 
+// Start a browsed-to song once the selection has been still for this long.
+const unsigned long browse_settle_ms = 500;
+bool browse_pending = false;
+unsigned long last_browse_millis;
+
+int display_volume = -1;
+uint8_t applied_volume = inaudible;
+unsigned long last_volume_change;
+
+// How often the playback position is written to the journal.
+const unsigned long journal_interval_ms = 5000;
+unsigned long last_journal_millis;
+
+// Where each leading filename character's songs start in the sorted list.
+struct JumpGroup {
+  char first;
+  uint16_t start;
+};
+std::vector<JumpGroup> jump_groups;
+
+// Playlist being played, or -1 for the whole library.
+int active_playlist = -1;
+
+// Set when the journal's song started before the library was loaded.
+bool started_early = false;
+String early_filename;
+
+// The library is imported a slice at a time from loop() when there's no
+// cache. Each step goes a song, merge or playlist at a time, over as many
+// frames as it takes.
+enum ImportStep {
+  import_reading,
+  import_sorting,
+  import_measuring,
+  import_caching,
+  import_playlists,
+  import_indexing,
+};
+
+bool importing = false;
+ImportStep import_step;
+// Next root directory entry to look at.
+uint16_t import_entry;
+int import_errors;
+unsigned long import_start_millis;
+unsigned long import_duration_micros;
+unsigned long max_duration_micros;
+// Running average of the time a song takes, to fit songs into the frame.
+unsigned long import_estimate_micros = 10000;
+
+// The cache is written a block at a time through one buffer, straight to a
+// file allocated at its full size, so the card only sees whole block writes
+// and the FAT is only touched when the file is created.
+struct CacheWriter {
+  // Counts the length without writing when set.
+  bool measuring;
+  uint32_t length;
+  uint32_t next_block;
+  uint16_t used;
+  uint32_t checksum;
+  bool failed;
+};
+
+// Sorting orders a list of song indices, in short runs and then merges of
+// runs of doubling width, so the songs stay where they are until it's done.
+const size_t sort_run = 32;
+std::vector<uint16_t> import_order;
+size_t sort_width;
+// Where the sorting, measuring and caching steps are up to.
+size_t import_position;
+// The cache as the import measures and writes it.
+CacheWriter import_writer;
+
+struct ImportCheckpoint {
+  uint32_t magic;
+  char cache_version[4];
+  // Next root directory entry to read.
+  uint16_t entry;
+  uint16_t errors;
+  // Songs in the partial list and its length. Anything after is from a
+  // chunk that didn't finish.
+  uint32_t song_count;
+  uint32_t bytes;
+  // Boots that carried on from here without reaching the next checkpoint.
+  uint8_t attempts;
+};
+
+// Whether the import in progress saves checkpoints, and its last one.
+bool import_resumable;
+ImportCheckpoint checkpoint;
+
+// Set while the song playing since boot hasn't been found by the import yet.
+bool awaiting_early_song = false;
+// Set when nothing is playing yet, so the first song imported should start.
+bool start_on_import = false;
+// Set when mass storage interrupted an import, so it has to start over.
+bool import_interrupted = false;
+
+// Where playback was when the card was handed over to mass storage.
+String resume_filename;
+uint32_t resume_offset;
+uint16_t resume_seconds;
+
 float readVolume();
+void updateVolume(unsigned long now);
+void loadLibrary(bool background);
+bool readSong(File &file, Song *song, uint32_t *checksum=NULL);
+void writeSong(File &file, const Song &song);
+bool saveCheckpoint();
+bool resumeImport();
+bool hasAcceptedExtension(const char *filename);
+void prepareNext();
+uint16_t decodeTime();
+bool loadPatch();
 bool readCache();
 bool writeCache();
+void writeCacheHeader(CacheWriter *writer);
+void writeCacheSong(CacheWriter *writer, const Song &song);
+bool openCache(CacheWriter *writer);
+bool closeCache(CacheWriter *writer);
+bool startPlaying(const Song &song, uint32_t offset, uint16_t seconds);
+bool playFrom(int song_index, uint32_t offset, uint16_t seconds);
+void recordPosition();
+void selectSong(int change);
+bool playSelected();
+void buildJumpIndex();
+int playlistLength();
+int playlistPosition(int song_index);
+int playlistSong(int position);
 
 bool vs1053_setup()
 {
@@ -109,15 +272,18 @@ bool vs1053_setup()
     led_blinkCode(no_VS1053);
     return false;
   }
+  boot_stage("VS1053 reset");
 
-  if (!SD.begin(CARDCS)) {
+  if (!SD.begin(CARDCS) || !card_setup()) {
     display_text("MicroSD failed or not present", boot_error);
     led_blinkCode(no_microsd);
     return false;
   }
+  boot_stage("card mount");
 
   display_text("Patching         VS1053", booting);
-  musicPlayer.applyPatch(plugin, pluginSize);
+  bool resident = loadPatch();
+  boot_stage(resident ? "patch (resident)" : "patch");
 
   // Don't initialize again.
   successful = true;
@@ -127,73 +293,259 @@ bool vs1053_setup()
 
 const char *const importStatus = "Cache build";
 
-void vs1053_importSongs()
+// Seconds of audio in an MP3, from the ID3v2 TLEN frame if there is one, or
+// else the first frame's headers. At most the start of the tag and the start
+// of the audio are read, whatever the size of the file or tag.
+uint16_t readDuration(File &file)
 {
-  char buf[512] = {};
-  int errors = 0;
-  int i = 0;
+  uint8_t data[1024];
 
-  display_text("Import start", importStatus);
+  if (!file.seek(0))
+    return 0;
 
-  auto root = SD.open("/");
+  int length = file.read(data, sizeof(data));
+  if (length <= 0)
+    return 0;
 
-  // Iterate root directory and load tags.
-  for (auto file = root.openNextFile(); file; file.close(), file = root.openNextFile()) {
-    if (file.isDirectory())
-      continue;
+  uint32_t tag_ms = mp3_tagLength(data, length);
+  if (tag_ms)
+    return tag_ms / 1000;
 
-    i++;
+  uint32_t audio_start = mp3_id3Length(data, length);
+  if (audio_start) {
+    if (!file.seek(audio_start))
+      return 0;
 
-    bool error = false;
-    if (strstr(file.name(), "\n"))  {
-      errors++;
-      error = true;
-    }
+    length = file.read(data, sizeof(data));
+    if (length <= 0)
+      return 0;
+  }
 
-    snprintf(buf, sizeof(buf), "Import song     %u", i + 1);
+  Mp3Info info;
+  if (!mp3_parse(data, length, audio_start, file.size(), &info))
+    return 0;
 
-    // Append error count if relevant.
-    if (errors)
-      snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), " | %d errors", errors);
+  return info.duration_ms / 1000;
+}
 
-    display_text(buf, importStatus);
+bool hasAcceptedExtension(const char *filename)
+{
+  const char *extension = strrchr(filename, '.');
+  if (!extension)
+    return false;
 
-    Serial.printf("%12s | ", file.name());
+  for (auto accepted : accepted_extensions) {
+    if (!strcmp(extension, accepted))
+      return true;
+  }
 
-    if (error) {
-      Serial.println("error - name contains newlines");
-      continue;
-    }
+  return false;
+}
 
-    if (mp3_id3_file_has_tags(&file)) {
-      const char* title = mp3_id3_file_read_tag(&file, MP3_ID3_TAG_TITLE);
-      const char* album = mp3_id3_file_read_tag(&file, MP3_ID3_TAG_ALBUM);
-      const char* artist = mp3_id3_file_read_tag(&file, MP3_ID3_TAG_ARTIST);
+// Start reading songs from the root directory into an empty list.
+void beginImport(bool resumable)
+{
+  songs.clear();
+
+  import_entry = 0;
+  import_errors = 0;
+  import_duration_micros = 0;
+  max_duration_micros = 0;
+  import_start_millis = millis();
+
+  import_resumable = resumable;
+  if (!resumable || resumeImport())
+    return;
+
+  // Nothing to carry on from.
+  SD.remove(partialFilename);
+  checkpoint = {};
+  checkpoint.magic = checkpoint_magic;
+  strncpy(checkpoint.cache_version, cacheVersion, sizeof(checkpoint.cache_version) - 1);
+  saveCheckpoint();
+}
 
-      // Songs are liable to not have an album set if manually tagged.
-      if (strlen(album)) {
-        snprintf(buf, sizeof(buf), "%s by %s in %s", title, artist, album);
-      } else {
-        snprintf(buf, sizeof(buf), "%s by %s", title, artist);
+bool saveCheckpoint()
+{
+  // Rewritten in place; it's always the same size.
+  auto file = SD.open(checkpointFilename, O_WRITE | O_CREAT);
+  if (!file)
+    return false;
+
+  bool written = file.write((const uint8_t *) &checkpoint, sizeof(checkpoint)) == sizeof(checkpoint);
+  file.close();
+
+  return written;
+}
+
+// Load the songs from an import that a reset interrupted, and carry on from
+// its checkpoint. Returns false if there wasn't one.
+bool resumeImport()
+{
+  ImportCheckpoint saved;
+  auto file = SD.open(checkpointFilename, FILE_READ);
+  if (!file)
+    return false;
+
+  bool valid = file.read(&saved, sizeof(saved)) == sizeof(saved) && saved.magic == checkpoint_magic &&
+               !strncmp(saved.cache_version, cacheVersion, sizeof(saved.cache_version));
+  file.close();
+  if (!valid)
+    return false;
+
+  auto partial = SD.open(partialFilename, FILE_READ);
+  Song song;
+  while (songs.size() < saved.song_count && readSong(partial, &song))
+    songs.push_back(song);
+  partial.close();
+
+  if (songs.size() != saved.song_count) {
+    songs.clear();
+    return false;
+  }
+
+  checkpoint = saved;
+  import_entry = saved.entry;
+  import_errors = saved.errors;
+
+  // Resetting twice without getting further means the next song hangs or
+  // crashes the import. After the first time songs are checkpointed one at
+  // a time, so the second time it's the next one, and it's left out.
+  if (checkpoint.attempts >= 2) {
+    CardEntry entry;
+    card_rewind(import_entry);
+    while (card_nextFile(&entry)) {
+      if (hasAcceptedExtension(entry.name)) {
+        Serial.printf("Leaving out %s, which stopped the import twice\r\n", entry.name);
+        import_entry = entry.dir_index + 1;
+        import_errors++;
+        break;
       }
+    }
+
+    checkpoint.entry = import_entry;
+    checkpoint.errors = import_errors;
+    checkpoint.attempts = 1;
+  } else {
+    checkpoint.attempts++;
+  }
+
+  saveCheckpoint();
+
+  Serial.printf("Carrying on with the import from %lu songs\r\n", checkpoint.song_count);
+
+  return true;
+}
+
+// Add the songs read since the last checkpoint to the partial list, then
+// move the checkpoint past them.
+void commitImport()
+{
+  auto file = SD.open(partialFilename, O_WRITE | O_CREAT);
+  if (!file || !file.seek(checkpoint.bytes)) {
+    file.close();
+    return;
+  }
+
+  for (size_t i = checkpoint.song_count; i < songs.size(); i++)
+    writeSong(file, songs[i]);
+
+  checkpoint.bytes = file.position();
+  file.close();
+
+  checkpoint.entry = import_entry;
+  checkpoint.errors = import_errors;
+  checkpoint.song_count = songs.size();
+  checkpoint.attempts = 0;
+  saveCheckpoint();
+}
 
-      free((void*)title);
-      free((void*)artist);
+// Once the cache is written, the import doesn't need to be resumed.
+void discardCheckpoint()
+{
+  SD.remove(checkpointFilename);
+  SD.remove(partialFilename);
+}
+
+// Read the next song in the root directory onto the end of the list. Returns
+// false once there are none left.
+bool importNext()
+{
+  char buf[512] = {};
+  CardEntry entry;
+
+  // Other card access moves the directory position between calls.
+  card_rewind(import_entry);
+
+  // Playlists and settings live alongside songs.
+  do {
+    if (!card_nextFile(&entry))
+      return false;
+  } while (!hasAcceptedExtension(entry.name));
+
+  import_entry = entry.dir_index + 1;
+
+  auto file = card_open(entry.dir_index, entry.first_cluster, entry.name);
+
+  if (!file || strstr(entry.name, "\n"))  {
+    import_errors++;
+    LOG_WARN("%12s | %s\r\n", entry.name, file ? "error - name contains newlines" : "error - failed to open");
+    file.close();
+    return true;
+  }
+
+  // Durations are only worked out for MP3s.
+  uint16_t duration = 0;
+  if (Adafruit_VS1053_FilePlayer::isMP3File(entry.name)) {
+    unsigned long duration_start = cpu_micros();
+    duration = readDuration(file);
+
+    unsigned long elapsed = cpu_micros() - duration_start;
+    import_duration_micros += elapsed;
+    max_duration_micros = max(max_duration_micros, elapsed);
+    LOG_DEBUG("%12s | %u:%02u in %lu us\r\n", entry.name, duration / 60, duration % 60, elapsed);
+  }
+
+  if (mp3_id3_file_has_tags(&file)) {
+    const char* title = mp3_id3_file_read_tag(&file, MP3_ID3_TAG_TITLE);
+    const char* album = mp3_id3_file_read_tag(&file, MP3_ID3_TAG_ALBUM);
+    const char* artist = mp3_id3_file_read_tag(&file, MP3_ID3_TAG_ARTIST);
+
+    // Songs are liable to not have an album set if manually tagged.
+    if (strlen(album)) {
+      snprintf(buf, sizeof(buf), "%s by %s in %s", title, artist, album);
     } else {
-      // Remove extension from filename in the absence of tags
-      // +1 for null terminator; -4 for ".mp3" or similar
-      size_t len = strlen(file.name()) + 1 - 4;
-      strncpy(buf, file.name(), len);
-      buf[len - 1] = '\0';
+      snprintf(buf, sizeof(buf), "%s by %s", title, artist);
     }
 
-    songs.push_back(Song{
-      .filename = file.name(),
-      .displayName = buf,
-    });
+    free((void*)title);
+    free((void*)artist);
+  } else {
+    // Remove extension from filename in the absence of tags
+    // +1 for null terminator; -4 for ".mp3" or similar
+    size_t len = strlen(entry.name) + 1 - 4;
+    strncpy(buf, entry.name, len);
+    buf[len - 1] = '\0';
   }
 
-  root.close();
+  file.close();
+
+  songs.push_back(Song{
+    .filename = entry.name,
+    .displayName = buf,
+    .dirIndex = entry.dir_index,
+    .firstCluster = entry.first_cluster,
+    .duration = duration,
+  });
+
+  return true;
+}
+
+// Put the imported songs in order.
+void finishImport()
+{
+  LOG_INFO("Durations took %lu ms, at most %lu us per song\r\n",
+           import_duration_micros / 1000, max_duration_micros);
 
   struct {
     bool operator()(const Song &a, const Song &b) { return a.filename < b.filename; }
@@ -203,45 +555,369 @@ void vs1053_importSongs()
   std::sort(songs.begin(), songs.end(), compareSongs);
 }
 
-void vs1053_loadSongs()
+// The same as finishImport(), a piece at a time: see sortNext().
+void beginSort()
+{
+  LOG_INFO("Durations took %lu ms, at most %lu us per song\r\n",
+           import_duration_micros / 1000, max_duration_micros);
+
+  import_order.resize(songs.size());
+  for (size_t i = 0; i < import_order.size(); i++)
+    import_order[i] = i;
+
+  sort_width = 0;
+  import_position = 0;
+}
+
+// Sort the next run of song indices, or merge the next pair of sorted runs.
+// Returns false once they're in order.
+bool sortNext()
+{
+  auto songBefore = [](uint16_t a, uint16_t b) { return songs[a].filename < songs[b].filename; };
+  auto order = import_order.begin();
+  size_t count = import_order.size();
+
+  size_t start = import_position;
+  if (!sort_width) {
+    size_t end = min(start + sort_run, count);
+    std::sort(order + start, order + end, songBefore);
+
+    import_position = end;
+    if (end == count) {
+      sort_width = sort_run;
+      import_position = 0;
+    }
+  } else {
+    size_t middle = min(start + sort_width, count);
+    size_t end = min(middle + sort_width, count);
+    std::inplace_merge(order + start, order + middle, order + end, songBefore);
+
+    import_position = end;
+    if (end == count) {
+      sort_width *= 2;
+      import_position = 0;
+    }
+  }
+
+  return sort_width < count;
+}
+
+// Move the songs into the sorted order, following each cycle of the
+// permutation, and keep the selection on the same song.
+void applyOrder()
+{
+  for (size_t i = 0; i < import_order.size(); i++) {
+    if (import_order[i] == selected_file_index) {
+      selected_file_index = i;
+      break;
+    }
+  }
+
+  for (size_t i = 0; i < import_order.size(); i++) {
+    if (import_order[i] == i)
+      continue;
+
+    Song held = std::move(songs[i]);
+    size_t j = i;
+    while (import_order[j] != i) {
+      size_t from = import_order[j];
+      songs[j] = std::move(songs[from]);
+      import_order[j] = j;
+      j = from;
+    }
+
+    songs[j] = std::move(held);
+    import_order[j] = j;
+  }
+
+  import_order.clear();
+  import_order.shrink_to_fit();
+}
+
+void vs1053_importSongs()
+{
+  char buf[64];
+
+  display_text("Import start", importStatus);
+
+  beginImport(false);
+  while (importNext()) {
+    snprintf(buf, sizeof(buf), "Import song     %u", songs.size() + import_errors);
+
+    // Append error count if relevant.
+    if (import_errors)
+      snprintf(buf + strlen(buf), sizeof(buf) - strlen(buf), " | %d errors", import_errors);
+
+    display_text(buf, importStatus);
+  }
+
+  finishImport();
+}
+
+void loadLibrary(bool background)
 {
   display_text("Loading songs", booting);
 
   unsigned long load_start = millis();
 
+  // Song indices are about to change.
+  active_playlist = -1;
+
   // Try to read the cache, but fall back to re-importing.
   bool usedCache = true;
   if (!readCache()) {
     usedCache = false;
+
+    if (background) {
+      Serial.println("No song cache; importing in the background");
+      beginImport(true);
+      import_step = import_reading;
+      importing = true;
+      return;
+    }
+
     vs1053_importSongs();
     writeCache();
+    discardCheckpoint();
   }
 
+  // Playlists refer to songs by index, so they're compiled along with the
+  // song cache.
+  if (!usedCache || !playlist_loadCache())
+    playlist_import();
+
   Serial.flush();
   Serial.print(songs.size());
   Serial.printf(" songs %s in ", usedCache ? "loaded from cache" : "imported");
   Serial.print(millis() - load_start);
   Serial.println(" milliseconds");
 
+  buildJumpIndex();
+  search_prepareIndex();
+}
+
+// Start playing, or take over the song already playing, as songs arrive.
+void adoptImported(int index)
+{
+  if (awaiting_early_song && songs[index].filename == early_filename) {
+    awaiting_early_song = false;
+    selected_file_index = index;
+    song_start_millis = millis();
+    song_millis_paused = 0;
+  } else if (start_on_import) {
+    start_on_import = false;
+    selected_file_index = index;
+    playSelected();
+  }
+}
+
+// Do the next piece of the step after reading. Returns false once the step
+// is finished and import_step has moved on.
+bool importPiece()
+{
+  switch (import_step) {
+  case import_sorting:
+    if (sortNext())
+      return true;
+
+    applyOrder();
+    import_writer = {};
+    import_writer.measuring = true;
+    writeCacheHeader(&import_writer);
+    import_step = import_measuring;
+    return false;
+
+  case import_measuring:
+    if (import_position < songs.size()) {
+      writeCacheSong(&import_writer, songs[import_position++]);
+      return true;
+    }
+
+    import_position = 0;
+    import_step = openCache(&import_writer) ? import_caching : import_playlists;
+    if (import_step == import_playlists)
+      playlist_beginImport();
+
+    return false;
+
+  case import_caching:
+    if (import_position < songs.size()) {
+      writeCacheSong(&import_writer, songs[import_position++]);
+      return true;
+    }
+
+    if (closeCache(&import_writer)) {
+      LOG_INFO("Wrote cache: %lu bytes\r\n", import_writer.length);
+      discardCheckpoint();
+    }
+
+    playlist_beginImport();
+    import_step = import_playlists;
+    return false;
+
+  case import_playlists:
+    if (playlist_importNext())
+      return true;
+
+    buildJumpIndex();
+    search_beginIndex();
+    import_step = import_indexing;
+    return false;
+
+  default:
+    if (search_buildIndex())
+      return true;
+
+    importing = false;
+
+    LOG_INFO("%u songs imported in %lu ms\r\n", songs.size(), millis() - import_start_millis);
+
+    if (songs.empty())
+      return false;
+
+    // The song playing since boot isn't in the library after all.
+    if (awaiting_early_song)
+      vs1053_changeSong(0);
+    else
+      prepareNext();
+
+    return false;
+  }
+}
+
+void importFor(unsigned long budget_us)
+{
+  unsigned long start = cpu_micros();
+
+  if (import_step == import_reading) {
+    // Keep going while another song looks like it'll fit.
+    do {
+      size_t song_count = songs.size();
+      unsigned long song_start = cpu_micros();
+
+      if (!importNext()) {
+        beginSort();
+        import_step = import_sorting;
+        return;
+      }
+
+      import_estimate_micros = (import_estimate_micros * 7 + (cpu_micros() - song_start)) / 8;
+
+      if (songs.size() > song_count)
+        adoptImported(songs.size() - 1);
+
+      // After a reset that lost progress, checkpoint every song.
+      size_t chunk = checkpoint.attempts ? 1 : checkpoint_songs;
+      if (import_resumable && songs.size() - checkpoint.song_count >= chunk)
+        commitImport();
+    } while (cpu_micros() - start + import_estimate_micros < budget_us);
+
+    return;
+  }
+
+  // Each step after reading goes in pieces small enough to check the time
+  // after each one. A step's last piece ends the frame's share, since it
+  // can be a longer one, like allocating the cache file.
+  while (importPiece()) {
+    if (cpu_micros() - start >= budget_us)
+      break;
+  }
+}
+
+void vs1053_import(unsigned long budget_us)
+{
+  // Importing waits for a later frame while it's over its share of the card.
+  if (!importing || !io_available(io_background))
+    return;
+
+  io_begin(io_background);
+  importFor(budget_us);
+  io_end(io_background);
+}
+
+bool vs1053_importing()
+{
+  return importing;
+}
+
+void buildJumpIndex()
+{
+  jump_groups.clear();
+
+  // Songs are sorted by filename, so each leading character's songs are
+  // together.
+  for (size_t i = 0; i < songs.size(); i++) {
+    char first = songs[i].filename[0];
+    if (jump_groups.empty() || jump_groups.back().first != first)
+      jump_groups.push_back(JumpGroup{first, (uint16_t) i});
+  }
+
+  jump_groups.shrink_to_fit();
+
+  Serial.printf("Jump index: %u groups\r\n", jump_groups.size());
+}
+
+// Index into jump_groups of the group containing the selected song: the last
+// one starting at or before it. Groups are sorted by start.
+size_t selectedGroup()
+{
+  auto next = std::upper_bound(jump_groups.begin(), jump_groups.end(), selected_file_index,
+                               [](int index, const JumpGroup &group) { return index < group.start; });
+
+  return next == jump_groups.begin() ? 0 : next - jump_groups.begin() - 1;
+}
+
+// Start the song the journal left off at before the library is loaded, so
+// loading it happens with audio playing. vs1053_start() takes it over once
+// the library is there.
+void startEarly()
+{
+  JournalRecord record;
+  CardEntry entry;
+  if (!journal_read(&record) || !card_find(record.filename, &entry))
+    return;
+
+  // An unmapped track plays only from what loop() reads ahead, and loading
+  // the library holds loop() up.
+  if (!stream_prepare(entry.name, entry.dir_index, entry.first_cluster) || !stream_preparedMapped())
+    return;
+
+  updateVolume(millis());
+
+  bool mp3 = Adafruit_VS1053_FilePlayer::isMP3File(entry.name);
+  if (!stream_start(mp3 ? record.offset : 0, mp3 ? record.seconds : 0))
+    return;
+
+  started_early = true;
+  early_filename = entry.name;
+  boot_firstAudio();
+  Serial.printf("Playing %s while the library loads\r\n", entry.name);
+}
+
+void vs1053_loadSongs()
+{
+  if (!journal_begin())
+    Serial.println("Journal unavailable; position won't be saved");
+
   // DREQ is on an interrupt pin, so use background audio playing
-  if (!musicPlayer.useInterrupt(VS1053_FILEPLAYER_PIN_INT)) {
+  if (!stream_begin(&musicPlayer, VS1053_DREQ)) {
     Serial.println("failed to set VS1053 interrupt");
     display_text("VS1053 interrupt setup failed", boot_error);
     while (true) led_blinkCode(no_VS1053);
   }
-}
+  boot_stage("journal");
 
-bool vs1053_loop()
-{
-  static int previous_display_volume = -1;
-  static unsigned long last_volume_change;
-  const unsigned long volume_change_display_ms = 1000;
+  startEarly();
+  boot_stage("first audio");
 
-  unsigned long start = millis();
-
-  const auto displayName = songs[selected_file_index].displayName.c_str();
+  loadLibrary(true);
+  boot_stage("library");
+}
 
-  // Because higher values given to musicPlayer.setVolume() are quieter, so
+// Read the potentiometer, and apply its volume if it moved.
+void updateVolume(unsigned long now)
+{
+  // Because higher values given to SCI_VOL are quieter, so
   // invert scaled ADC. Low ADC numbers give high volume values to be quiet.
   // Pot
   uint8_t volume = (uint8_t) ((1.0f - readVolume()) * inaudible);
@@ -253,73 +929,403 @@ bool vs1053_loop()
   // Only change volume setting if the displayed value is different.
   // 100% volume is 0
   // 0% volume is inaudible
-  int display_volume = roundf(100 - (100.0f/inaudible)*volume);
-  if (previous_display_volume != display_volume) {
-    Serial.printf("Volume %d%%: %d\n", display_volume, volume);
-    musicPlayer.setVolume(volume, volume);
+  int new_display_volume = roundf(100 - (100.0f/inaudible)*volume);
+  if (display_volume != new_display_volume) {
+    LOG_EVENT(LOG_LEVEL_DEBUG, "Volume %ld%%: %lu\r\n", new_display_volume, volume);
 
-    previous_display_volume = display_volume;
-    last_volume_change = start;
+    applied_volume = volume;
+    display_volume = new_display_volume;
+    last_volume_change = now;
   }
 
-  bool display_updated = false;
-  if (start - last_volume_change < volume_change_display_ms) {
-      char buf[32];
-      // Pad with two spaces to leave room for "100%"
-      snprintf(buf, sizeof(buf), "    Vol %d%%", display_volume);
+  // Only written when it changes, or after a reset.
+  sci_set(VS1053_REG_VOLUME, applied_volume << 8 | applied_volume);
+}
 
-      display_updated = display_text(displayName, buf);
-  } else if (paused) {
-    display_updated = display_text(displayName,
-                                  "    Paused");
-  } else {
-    auto seconds_played = musicPlayer.decodeTime();
-    char buf[32];
+void vs1053_loop()
+{
+  unsigned long start = millis();
 
-    // TODO: Instead of hardcoding %02d for song number, determine digits in song count and match it.
-    // Playtime in minutes:seconds song number/song count
-    snprintf(buf, sizeof(buf), "%d:%02d %02d/%u",
-             seconds_played / 60, seconds_played % 60,
-             selected_file_index + 1, songs.size());
+  updateVolume(start);
 
-    display_updated = display_text(displayName, buf);
+  // Nothing to do until the import finds a song.
+  if (songs.empty())
+    return;
+
+  // Start the browsed-to song once the encoder settles.
+  if (browse_pending && start - last_browse_millis >= browse_settle_ms) {
+    browse_pending = false;
+    playSelected();
   }
 
+  // The header registers fill in once the decoder recognizes the format.
+  if (latency_waiting(latency_decoding) && sci_read(VS1053_REG_HDAT1))
+    latency_mark(latency_decoding);
+
   // Advance to the next song upon completion.
-  if (!paused && !musicPlayer.playingMusic)
+  if (!paused && !browse_pending && !stream_playing())
     vs1053_changeSong(1);
 
-  return display_updated;
+  // Note the position every so often, so a reset picks up about here.
+  if (!browse_pending && !awaiting_early_song && stream_playing() &&
+      start - last_journal_millis >= journal_interval_ms) {
+    last_journal_millis = start;
+    recordPosition();
+  }
+}
+
+void recordPosition()
+{
+  JournalRecord record = {};
+  record.song_index = selected_file_index;
+  strncpy(record.filename, songs[selected_file_index].filename.c_str(), sizeof(record.filename) - 1);
+  record.playlist = active_playlist;
+  record.offset = stream_position();
+  record.seconds = decodeTime();
+
+  // Nothing to write while paused.
+  JournalRecord last;
+  if (journal_read(&last) && last.song_index == record.song_index &&
+      last.offset == record.offset && last.playlist == record.playlist) {
+    return;
+  }
+
+  // A block write is usually a millisecond or two, and the decoder holds more
+  // than that, but cards occasionally take much longer.
+  io_begin(io_background);
+  unsigned long write_start = cpu_micros();
+  if (!journal_write(record))
+    LOG_WARN("Journal write failed\r\n");
+
+  unsigned long write_micros = cpu_micros() - write_start;
+  io_end(io_background);
+  if (write_micros > 10000)
+    LOG_EVENT(LOG_LEVEL_WARN, "Slow journal write: %lu us\r\n", write_micros);
+}
+
+bool vs1053_seek(int change)
+{
+  // Moving off a browsed-to song that hasn't started yet doesn't mean much.
+  if (browse_pending || !stream_playing())
+    return false;
+
+  int seconds = decodeTime() + change;
+  int duration = stream_duration();
+  seconds = max(0, min(seconds, duration - 1));
+
+  unsigned long seek_start = cpu_micros();
+  if (!stream_seek(seconds)) {
+    LOG_INFO("Can't seek in this song\r\n");
+    return false;
+  }
+
+  LOG_EVENT(LOG_LEVEL_INFO, "Seeked to %lu s in %lu us\r\n", seconds, cpu_micros() - seek_start);
+
+  return true;
+}
+
+bool vs1053_start()
+{
+  // Keep playing the song started at boot until the import finds it, or
+  // start with the first song it finds.
+  if (importing) {
+    if (started_early)
+      awaiting_early_song = true;
+    else
+      start_on_import = true;
+
+    // Songs from an import interrupted by a reset are in already.
+    for (size_t i = 0; i < songs.size(); i++)
+      adoptImported(i);
+
+    return true;
+  }
+
+  JournalRecord record;
+  if (!journal_read(&record))
+    return vs1053_changeSong(0);
+
+  // The index is right unless the library changed since.
+  int index = record.song_index;
+  if (index >= (int) songs.size() || songs[index].filename != record.filename)
+    index = vs1053_findSong(record.filename);
+
+  if (record.playlist < playlist_count())
+    active_playlist = record.playlist;
+
+  // Already playing; the library just needs to catch up. If it finished in
+  // the meantime, the next loop moves on.
+  if (started_early && index >= 0) {
+    selected_file_index = index;
+    song_start_millis = millis();
+    song_millis_paused = 0;
+
+    prepareNext();
+
+    return true;
+  }
+
+  LOG_INFO("Resuming %s at byte %lu\r\n", record.filename, record.offset);
+
+  return playFrom(index, record.offset, record.seconds);
+}
+
+bool vs1053_display(const char *status)
+{
+  const unsigned long volume_change_display_ms = 1000;
+
+  char buf[32];
+  if (songs.empty() || awaiting_early_song) {
+    snprintf(buf, sizeof(buf), "%u found", songs.size());
+    return display_text("Importing songs", buf);
+  }
+
+  const auto displayName = songs[selected_file_index].displayName.c_str();
+
+  if (status) {
+    return display_text(displayName, status);
+  } else if (browse_pending) {
+    snprintf(buf, sizeof(buf), "> %02d/%d", playlistPosition(selected_file_index) + 1, playlistLength());
+
+    return display_text(displayName, buf);
+  } else if (millis() - last_volume_change < volume_change_display_ms) {
+    // Pad with two spaces to leave room for "100%"
+    snprintf(buf, sizeof(buf), "    Vol %d%%", display_volume);
+
+    return display_text(displayName, buf);
+  } else if (paused) {
+    return display_text(displayName,
+                        "    Paused");
+  } else {
+    int seconds_played = decodeTime();
+    int duration = songs[selected_file_index].duration;
+
+    // TODO: Instead of hardcoding %02d for song number, determine digits in song count and match it.
+    if (!duration) {
+      // Playtime in minutes:seconds song number/song count
+      snprintf(buf, sizeof(buf), "%d:%02d %02d/%d",
+               seconds_played / 60, seconds_played % 60,
+               playlistPosition(selected_file_index) + 1, playlistLength());
+
+      return display_text(displayName, buf);
+    }
+
+    // Time remaining, with a bar for how far through the song it is.
+    int remaining = max(duration - seconds_played, 0);
+    snprintf(buf, sizeof(buf), "-%d:%02d %02d/%d",
+             remaining / 60, remaining % 60,
+             playlistPosition(selected_file_index) + 1, playlistLength());
+
+    return display_text(displayName, buf, min((float) seconds_played / duration, 1.0f));
+  }
 }
 
 bool vs1053_changeSong(int encoder_change)
 {
-  Serial.print("Moving ");
-  Serial.print(encoder_change);
+  selectSong(encoder_change);
+  return playSelected();
+}
+
+bool vs1053_play(int index)
+{
+  if (songs.empty())
+    return false;
+
+  browse_pending = false;
+  selected_file_index = index;
+
+  return playSelected();
+}
+
+int vs1053_songCount()
+{
+  return songs.size();
+}
+
+int vs1053_findSong(const char *filename)
+{
+  auto found = std::lower_bound(songs.begin(), songs.end(), filename,
+                                [](const Song &song, const char *name) { return song.filename < name; });
+  if (found == songs.end() || found->filename != filename)
+    return -1;
+
+  return found - songs.begin();
+}
+
+bool vs1053_selectPlaylist(int playlist)
+{
+  if (songs.empty())
+    return false;
+
+  active_playlist = playlist;
+
+  LOG_INFO("Playing %s\r\n", playlist < 0 ? "all songs" : playlist_name(playlist));
+
+  browse_pending = false;
+  selected_file_index = playlistSong(0);
+
+  return playSelected();
+}
+
+int vs1053_playlist()
+{
+  return active_playlist;
+}
+
+const char *vs1053_songName(int index)
+{
+  return songs[index].displayName.c_str();
+}
+
+void vs1053_browse(int encoder_change)
+{
+  if (songs.empty())
+    return;
+
+  selectSong(encoder_change);
+
+  latency_mark(latency_selected);
+
+  browse_pending = true;
+  last_browse_millis = millis();
+}
+
+void vs1053_jump(int direction)
+{
+  if (jump_groups.empty())
+    return;
+
+  int group = selectedGroup();
+  int group_count = jump_groups.size();
+
+  for (; direction > 0; direction--) {
+    group = (group + 1) % group_count;
+    selected_file_index = jump_groups[group].start;
+  }
+
+  for (; direction < 0; direction++) {
+    // Back to the start of the current group first, as with previous track
+    // buttons.
+    if (jump_groups[group].start == selected_file_index)
+      group = (group + group_count - 1) % group_count;
+
+    selected_file_index = jump_groups[group].start;
+  }
+
+  LOG_EVENT(LOG_LEVEL_INFO, "Jumped to '%c' at %lu\r\n", jump_groups[group].first, selected_file_index + 1);
+
+  latency_mark(latency_selected);
+
+  browse_pending = true;
+  last_browse_millis = millis();
+}
+
+char vs1053_jumpGroup()
+{
+  return jump_groups.empty() ? ' ' : jump_groups[selectedGroup()].first;
+}
+
+void vs1053_setShuffle(bool shuffle)
+{
+  if (shuffle == settings.shuffle)
+    return;
+
+  settings.shuffle = shuffle;
+
+  // A new order each time it's turned on, which then lasts across reboots.
+  if (shuffle)
+    settings.shuffle_seed = micros() ^ ((uint32_t) analogRead(volume_pin) << 16);
 
-  selected_file_index += encoder_change;
+  io_begin(io_interactive);
+  settings_save();
+  io_end(io_interactive);
+
+  LOG_INFO("Shuffle %s\r\n", shuffle ? "on" : "off");
+
+  if (songs.empty())
+    return;
+
+  // The song after this one is different now.
+  prepareNext();
+}
 
-  // Wrap around playlist when negative.
-  while (selected_file_index < 0) {
-    selected_file_index += songs.size();
+bool vs1053_shuffle()
+{
+  return settings.shuffle;
+}
+
+int playlistLength()
+{
+  return active_playlist < 0 ? songs.size() : playlist_songs(active_playlist).size();
+}
+
+// Position in the play order of a song in the library. The play order is the
+// active playlist, or the library, shuffled if shuffle is on.
+int playlistPosition(int song_index)
+{
+  int entry = song_index;
+  if (active_playlist >= 0) {
+    auto &list = playlist_songs(active_playlist);
+    auto found = std::find(list.begin(), list.end(), song_index);
+
+    // A song picked from outside the playlist comes just before its start.
+    if (found == list.end())
+      return -1;
+
+    entry = found - list.begin();
   }
 
-  // Wrap around playlist when beyond its length.
-  selected_file_index = selected_file_index % songs.size();
+  if (!settings.shuffle)
+    return entry;
+
+  return shuffle_position(entry, playlistLength(), settings.shuffle_seed);
+}
 
+// Song at a position in the play order, wrapping around at either end.
+int playlistSong(int position)
+{
+  int count = playlistLength();
+  position = (position % count + count) % count;
+
+  int entry = position;
+  if (settings.shuffle)
+    entry = shuffle_song(position, count, settings.shuffle_seed);
+
+  return active_playlist < 0 ? entry : playlist_songs(active_playlist)[entry];
+}
+
+void selectSong(int encoder_change)
+{
+  selected_file_index = playlistSong(playlistPosition(selected_file_index) + encoder_change);
+
+  LOG_EVENT(LOG_LEVEL_DEBUG, "Moved %lu to song %lu\r\n", (unsigned long) encoder_change,
+            (unsigned long) (selected_file_index + 1));
+}
+
+bool playSelected()
+{
   auto selectedSong = songs[selected_file_index];
+  unsigned long switch_start = cpu_micros();
 
-  Serial.print(" to '");
-  Serial.print(selectedSong.displayName);
-  Serial.println("'");
+  latency_mark(latency_settled);
 
-  musicPlayer.stopPlaying();
+  // Whatever was playing since boot is replaced.
+  awaiting_early_song = false;
+
+  // Cancelling leaves the decoder ready for the next song, and starting it
+  // sets decodeTime(). A soft reset clicks and takes over 100 ms, so it's
+  // only for when cancelling doesn't work. Patches don't survive it, but
+  // most of the patch does.
+  if (!stream_stop()) {
+    LOG_WARN("Decoder didn't cancel; resetting\r\n");
+    musicPlayer.softReset();
+    loadPatch();
+  }
 
-  // Clear decodeTime() so elapsed time doesn't accumulate between songs.
-  musicPlayer.softReset();
+  latency_mark(latency_stopped);
 
-  if (!musicPlayer.startPlayingFile(selectedSong.filename.c_str())) {
-    musicPlayer.stopPlaying();
+  if (!startPlaying(selectedSong, 0, 0)) {
+    stream_stop();
 
     for (int i = 0; i < 128; i++) {
       display_text(selectedSong.displayName.c_str(), "start failed");
@@ -327,28 +1333,204 @@ bool vs1053_changeSong(int encoder_change)
     return false;
   }
 
+  LOG_EVENT(LOG_LEVEL_INFO, "Switched songs in %lu us\r\n", cpu_micros() - switch_start);
+
   song_start_millis = millis();
   song_millis_paused = 0;
 
   return true;
 }
 
+void vs1053_suspend()
+{
+  // The card may change, so an unfinished import starts over after. The
+  // search index it may be writing is closed now, while the card is ours.
+  if (importing) {
+    importing = false;
+    import_interrupted = true;
+    search_abortIndex();
+  }
+
+  if (awaiting_early_song)
+    resume_filename = early_filename;
+  else
+    resume_filename = songs.empty() ? String() : songs[selected_file_index].filename;
+  resume_offset = stream_position();
+  resume_seconds = decodeTime();
+
+  // The selection moved off the playing song, so start the new one.
+  if (browse_pending) {
+    browse_pending = false;
+    resume_offset = 0;
+    resume_seconds = 0;
+  }
+
+  // Close files so the host can have the card.
+  stream_close();
+}
+
+bool vs1053_resume(bool card_modified)
+{
+  // Mass storage wrote to the card underneath the SD library, so discard its
+  // cached block and mount the volume again.
+  SdVolume::cacheClear();
+  SD.end();
+  if (!SD.begin(CARDCS) || !card_setup()) {
+    display_text("MicroSD failed or not present", boot_error);
+    return false;
+  }
+
+  // The host may have moved or removed the journal.
+  if (!journal_begin())
+    Serial.println("Journal unavailable; position won't be saved");
+
+  if (card_modified || import_interrupted) {
+    songs.clear();
+    loadLibrary(false);
+
+    import_interrupted = false;
+    awaiting_early_song = false;
+    start_on_import = false;
+  } else {
+    // Nothing changed, so the song list in memory is still accurate. Restore
+    // the cache that mass storage mode removed.
+    writeCache();
+  }
+
+  if (songs.empty())
+    return false;
+
+  if (!playFrom(vs1053_findSong(resume_filename.c_str()), resume_offset, resume_seconds))
+    return false;
+
+  if (paused)
+    stream_pause(true);
+
+  return true;
+}
+
+// Pick up a song where it was, or start from the beginning if it's gone.
+bool playFrom(int song_index, uint32_t offset, uint16_t seconds)
+{
+  if (song_index < 0) {
+    selected_file_index = 0;
+    return vs1053_changeSong(0);
+  }
+
+  selected_file_index = song_index;
+  if (!startPlaying(songs[song_index], offset, seconds))
+    return vs1053_changeSong(0);
+
+  song_start_millis = millis();
+  song_millis_paused = 0;
+
+  return true;
+}
+
+bool startPlaying(const Song &song, uint32_t offset, uint16_t seconds)
+{
+  const char *filename = song.filename.c_str();
+
+  io_begin(io_interactive);
+  bool prepared = stream_prepare(filename, song.dirIndex, song.firstCluster);
+  io_end(io_interactive);
+
+  if (!prepared)
+    return false;
+
+  // The decoder resynchronizes on MP3 frame headers, so it's safe to jump
+  // into the middle. Other formats start over.
+  if (!Adafruit_VS1053_FilePlayer::isMP3File(filename)) {
+    offset = 0;
+    seconds = 0;
+  }
+
+  if (!stream_start(offset, seconds))
+    return false;
+
+  prepareNext();
+
+  return true;
+}
+
+// Map the song after the selected one now, so it can start without a FAT
+// walk.
+void prepareNext()
+{
+  const Song &next = songs[playlistSong(playlistPosition(selected_file_index) + 1)];
+  io_begin(io_background);
+  stream_prepare(next.filename.c_str(), next.dirIndex, next.firstCluster);
+  io_end(io_background);
+}
+
 void vs1053_pause(bool pause)
 {
   paused = pause;
 
-  if (paused) {
-    Serial.println("Pause");
-  } else {
-    Serial.println("Resume");
+  LOG_INFO("%s\r\n", paused ? "Pause" : "Resume");
+
+  stream_pause(paused);
+}
+
+// Seconds into the playing song, without asking the chip every frame.
+uint16_t decodeTime()
+{
+  return sci_decodeTime(!paused && stream_playing());
+}
+
+// Returns whether the patch was mostly loaded already.
+bool loadPatch()
+{
+  sci_begin(VS1053_CS, VS1053_DCS, VS1053_DREQ);
+  return sci_loadPlugin(plugin, pluginSize);
+}
+
+unsigned long vs1053_timeDataWrite(uint32_t bytes)
+{
+  // Zeros are skipped over by the decoder, so this is the bus speed with
+  // DREQ flow control.
+  uint8_t zeros[VS1053_DATABUFFERLEN] = {};
+
+  unsigned long start = cpu_micros();
+  for (uint32_t sent = 0; sent < bytes; sent += sizeof(zeros)) {
+    while (!musicPlayer.readyForData());
+    sci_writeData(zeros, sizeof(zeros));
   }
 
-  musicPlayer.pausePlaying(paused);
+  return cpu_micros() - start;
+}
+
+void vs1053_timeLibrary(unsigned long *import_us, unsigned long *cache_write_us,
+                        unsigned long *cache_load_us, int *song_count)
+{
+  songs.clear();
+
+  unsigned long start = cpu_micros();
+  vs1053_importSongs();
+  *import_us = cpu_micros() - start;
+  *song_count = songs.size();
+
+  start = cpu_micros();
+  writeCache();
+  *cache_write_us = cpu_micros() - start;
+  songs.clear();
+
+  start = cpu_micros();
+  readCache();
+  *cache_load_us = cpu_micros() - start;
+
+  // The library might have changed, so bring playlists in line with it.
+  playlist_import();
+
+  songs.clear();
 }
 
 void vs1053_beep(uint16_t duration_ms, uint8_t frequency_code)
 {
   musicPlayer.sineTest(frequency_code, duration_ms);
+
+  // The sine test resets the chip, so the shadowed registers are stale.
+  sci_begin(VS1053_CS, VS1053_DCS, VS1053_DREQ);
 }
 
 float readVolume()
@@ -384,6 +1566,54 @@ float readVolume()
 void vs1053_clearSongCache()
 {
   SD.remove(cacheFilename);
+  discardCheckpoint();
+}
+
+// Add a line read without its newline to a cache checksum.
+uint32_t checksumLine(uint32_t hash, const String &line)
+{
+  for (size_t i = 0; i < line.length(); i++)
+    hash = (hash ^ (uint8_t) line[i]) * 16777619u;
+
+  return (hash ^ '\n') * 16777619u;
+}
+
+// Read a song in the cache's format, adding it to checksum if given. Returns
+// false at the end.
+bool readSong(File &file, Song *song, uint32_t *checksum)
+{
+  if (!file.available())
+    return false;
+
+  song->filename = file.readStringUntil('\n');
+  song->displayName = file.readStringUntil('\n');
+  auto location = file.readStringUntil('\n');
+
+  if (checksum) {
+    *checksum = checksumLine(*checksum, song->filename);
+    *checksum = checksumLine(*checksum, song->displayName);
+    *checksum = checksumLine(*checksum, location);
+  }
+
+  unsigned long dirIndex = 0;
+  unsigned long firstCluster = 0;
+  unsigned long duration = 0;
+  sscanf(location.c_str(), "%lu %lu %lu", &dirIndex, &firstCluster, &duration);
+
+  song->dirIndex = dirIndex;
+  song->firstCluster = firstCluster;
+  song->duration = duration;
+
+  return true;
+}
+
+void writeSong(File &file, const Song &song)
+{
+  file.write(song.filename.c_str());
+  file.write('\n');
+  file.write(song.displayName.c_str());
+  file.write('\n');
+  file.printf("%u %lu %u\n", song.dirIndex, song.firstCluster, song.duration);
 }
 
 bool readCache()
@@ -396,44 +1626,148 @@ bool readCache()
     return false;
   }
 
+  auto version = cacheFile.readStringUntil('\n');
+  if (version != cacheVersion || cacheFile.size() < cache_trailer_length) {
+    Serial.println("Cache is from an older version");
+    cacheFile.close();
+    return false;
+  }
+
   display_text("Loading cache", booting);
   Serial.println("Loading cache");
 
-  while (cacheFile.available()) {
-    auto filename = cacheFile.readStringUntil('\n');
-    auto displayName = cacheFile.readStringUntil('\n');
+  uint32_t checksum = checksumLine(2166136261u, version);
+  uint32_t songs_end = cacheFile.size() - cache_trailer_length;
 
-    Serial.printf("%12s | ", filename);
-    Serial.println(displayName);
+  Song song;
+  while (cacheFile.position() < songs_end && readSong(cacheFile, &song, &checksum)) {
+    Serial.printf("%12s | ", song.filename.c_str());
+    Serial.println(song.displayName);
 
-    songs.push_back(Song{
-      .filename = filename,
-      .displayName = displayName,
-    });
+    songs.push_back(song);
   }
 
+  char expected[cache_trailer_length];
+  snprintf(expected, sizeof(expected), "#%08lx", checksum);
+  bool intact = cacheFile.position() == songs_end && cacheFile.readStringUntil('\n') == expected;
   cacheFile.close();
+
+  // Written partway, or damaged since.
+  if (!intact) {
+    Serial.println("Cache checksum doesn't match");
+    songs.clear();
+    return false;
+  }
+
   return true;
 }
 
-bool writeCache()
+uint8_t cache_buffer[512];
+
+void flushCache(CacheWriter *writer)
 {
-  auto cacheFile = SD.open(cacheFilename, FILE_WRITE);
-  if (!cacheFile) {
-    Serial.println("Failed to open cache file");
-    return false;
+  if (!writer->used)
+    return;
+
+  memset(cache_buffer + writer->used, 0, sizeof(cache_buffer) - writer->used);
+  if (!card_writeBlock(writer->next_block++, cache_buffer))
+    writer->failed = true;
+
+  writer->used = 0;
+}
+
+void cacheWrite(CacheWriter *writer, const char *data, size_t length)
+{
+  writer->length += length;
+  if (writer->measuring)
+    return;
+
+  for (size_t i = 0; i < length; i++) {
+    writer->checksum = (writer->checksum ^ (uint8_t) data[i]) * 16777619u;
+
+    cache_buffer[writer->used++] = data[i];
+    if (writer->used == sizeof(cache_buffer))
+      flushCache(writer);
   }
+}
+
+void writeCacheHeader(CacheWriter *writer)
+{
+  cacheWrite(writer, cacheVersion, strlen(cacheVersion));
+  cacheWrite(writer, "\n", 1);
+}
+
+void writeCacheSong(CacheWriter *writer, const Song &song)
+{
+  char location[32];
+
+  cacheWrite(writer, song.filename.c_str(), song.filename.length());
+  cacheWrite(writer, "\n", 1);
+  cacheWrite(writer, song.displayName.c_str(), song.displayName.length());
+  cacheWrite(writer, "\n", 1);
+
+  int length = snprintf(location, sizeof(location), "%u %lu %u\n",
+                        song.dirIndex, song.firstCluster, song.duration);
+  cacheWrite(writer, location, length);
+}
+
+// Allocate the temporary file at the length the writer measured, and start
+// writing to it.
+bool openCache(CacheWriter *writer)
+{
+  uint32_t size = writer->length + cache_trailer_length;
+
+  SD.mkdir(cacheDirectory);
+
+  *writer = {};
+  writer->checksum = 2166136261u;
+  if (!card_createContiguous(cacheDirectory, cacheTempName, size, &writer->next_block))
+    return false;
+
+  writeCacheHeader(writer);
+
+  return true;
+}
 
-  for (auto song : songs) {
-    cacheFile.write(song.filename.c_str());
-    cacheFile.write('\n');
-    cacheFile.write(song.displayName.c_str());
-    cacheFile.write('\n');
+// Add the trailer, and rename the temporary file over the old cache.
+bool closeCache(CacheWriter *writer)
+{
+  char trailer[cache_trailer_length + 1];
+  snprintf(trailer, sizeof(trailer), "#%08lx\n", writer->checksum);
+  cacheWrite(writer, trailer, cache_trailer_length);
+  flushCache(writer);
+
+  if (writer->failed || !card_rename(cacheDirectory, cacheTempName, cacheName)) {
+    Serial.println("Failed to write cache");
+    return false;
   }
 
-  cacheFile.close();
+  return true;
+}
+
+// Write the whole cache to a temporary file, and then rename it over the old
+// one, so a reset partway through leaves the old cache, or none, but never
+// part of one.
+bool writeCache()
+{
+  unsigned long start = cpu_micros();
+
+  CacheWriter writer = {};
+  writer.measuring = true;
+  writeCacheHeader(&writer);
+  for (auto &song : songs)
+    writeCacheSong(&writer, song);
+
+  if (!openCache(&writer))
+    return false;
+
+  for (auto &song : songs)
+    writeCacheSong(&writer, song);
+
+  if (!closeCache(&writer))
+    return false;
 
-  Serial.println("Wrote cache");
+  Serial.printf("Wrote cache: %lu bytes in %lu us\r\n", writer.length, cpu_micros() - start);
 
   return true;
 }
@@ -0,0 +1,190 @@
+#include <extents.h>
+
+#include <string.h>
+#include <unity.h>
+
+// A fake card holding just a FAT, with 4 blocks per cluster.
+const uint32_t fat_start = 10;
+const uint32_t fat_blocks = 8;
+const uint8_t blocks_per_cluster = 4;
+const uint32_t cluster_bytes = blocks_per_cluster * 512;
+
+uint8_t fat[fat_blocks * 512];
+FatGeometry geometry;
+uint32_t fat_reads;
+
+bool readBlock(uint32_t block, uint8_t *dst)
+{
+  fat_reads++;
+  if (block < fat_start || block >= fat_start + fat_blocks)
+    return false;
+
+  memcpy(dst, fat + (block - fat_start) * 512, 512);
+  return true;
+}
+
+void setEntry(uint32_t cluster, uint32_t next)
+{
+  if (geometry.fat_type == 16) {
+    fat[cluster * 2] = next;
+    fat[cluster * 2 + 1] = next >> 8;
+  } else {
+    for (uint8_t i = 0; i < 4; i++)
+      fat[cluster * 4 + i] = next >> (i * 8);
+  }
+}
+
+// Chain the clusters in order, ending the chain after the last.
+void chain(const uint32_t *clusters, size_t count)
+{
+  for (size_t i = 0; i + 1 < count; i++)
+    setEntry(clusters[i], clusters[i + 1]);
+  setEntry(clusters[count - 1], geometry.fat_type == 16 ? 0xFFFF : 0x0FFFFFFF);
+}
+
+void setUp()
+{
+  memset(fat, 0, sizeof(fat));
+  geometry = FatGeometry{16, blocks_per_cluster, 2000, fat_start};
+  fat_reads = 0;
+}
+
+void tearDown() {}
+
+void test_contiguous()
+{
+  const uint32_t clusters[] = {5, 6, 7, 8};
+  chain(clusters, 4);
+
+  std::vector<CardExtent> extents;
+  TEST_ASSERT_TRUE(extents_build(geometry, readBlock, 5, 4 * cluster_bytes - 100, &extents, 256));
+  TEST_ASSERT_EQUAL(1, extents.size());
+  TEST_ASSERT_EQUAL(5, extents[0].first_cluster);
+  TEST_ASSERT_EQUAL(4, extents[0].cluster_count);
+  // The chain's entries share a FAT block.
+  TEST_ASSERT_EQUAL(1, fat_reads);
+}
+
+void test_contiguous_fat32()
+{
+  geometry.fat_type = 32;
+  const uint32_t clusters[] = {300, 301, 302};
+  chain(clusters, 3);
+  // The top four bits of a FAT32 entry are reserved.
+  fat[300 * 4 + 3] |= 0xF0;
+
+  std::vector<CardExtent> extents;
+  TEST_ASSERT_TRUE(extents_build(geometry, readBlock, 300, 3 * cluster_bytes, &extents, 256));
+  TEST_ASSERT_EQUAL(1, extents.size());
+  TEST_ASSERT_EQUAL(300, extents[0].first_cluster);
+  TEST_ASSERT_EQUAL(3, extents[0].cluster_count);
+}
+
+void test_fragmented()
+{
+  const uint32_t clusters[] = {5, 6, 700, 701, 702, 9};
+  chain(clusters, 6);
+
+  std::vector<CardExtent> extents;
+  TEST_ASSERT_TRUE(extents_build(geometry, readBlock, 5, 6 * cluster_bytes, &extents, 256));
+  TEST_ASSERT_EQUAL(3, extents.size());
+  TEST_ASSERT_EQUAL(5, extents[0].first_cluster);
+  TEST_ASSERT_EQUAL(2, extents[0].cluster_count);
+  TEST_ASSERT_EQUAL(700, extents[1].first_cluster);
+  TEST_ASSERT_EQUAL(3, extents[1].cluster_count);
+  TEST_ASSERT_EQUAL(9, extents[2].first_cluster);
+  TEST_ASSERT_EQUAL(1, extents[2].cluster_count);
+}
+
+void test_broken_chain()
+{
+  std::vector<CardExtent> extents;
+
+  // A free entry in the middle of the file.
+  setEntry(5, 6);
+  TEST_ASSERT_FALSE(extents_build(geometry, readBlock, 5, 3 * cluster_bytes, &extents, 256));
+
+  // The chain ends before the file does.
+  const uint32_t clusters[] = {20, 21};
+  chain(clusters, 2);
+  TEST_ASSERT_FALSE(extents_build(geometry, readBlock, 20, 3 * cluster_bytes, &extents, 256));
+
+  // A cluster past the end of the volume.
+  setEntry(30, 5000);
+  TEST_ASSERT_FALSE(extents_build(geometry, readBlock, 30, 2 * cluster_bytes, &extents, 256));
+
+  // The FAT can't be read.
+  geometry.fat_start_block = 100;
+  TEST_ASSERT_FALSE(extents_build(geometry, readBlock, 5, 2 * cluster_bytes, &extents, 256));
+}
+
+void test_extent_cap()
+{
+  // Every other cluster, so each is its own extent.
+  uint32_t clusters[257];
+  for (size_t i = 0; i < 257; i++)
+    clusters[i] = 2 + i * 2;
+  chain(clusters, 257);
+
+  std::vector<CardExtent> extents;
+  TEST_ASSERT_TRUE(extents_build(geometry, readBlock, 2, 256 * cluster_bytes, &extents, 256));
+  TEST_ASSERT_EQUAL(256, extents.size());
+  TEST_ASSERT_FALSE(extents_build(geometry, readBlock, 2, 257 * cluster_bytes, &extents, 256));
+}
+
+void test_empty_file()
+{
+  std::vector<CardExtent> extents{{5, 1}};
+  TEST_ASSERT_TRUE(extents_build(geometry, readBlock, 0, 0, &extents, 256));
+  TEST_ASSERT_EQUAL(0, extents.size());
+}
+
+void test_locate()
+{
+  const std::vector<CardExtent> extents{{5, 2}, {700, 3}};
+  ExtentCursor cursor = {};
+  uint32_t first_cluster;
+  uint32_t block_offset;
+
+  TEST_ASSERT_TRUE(extents_locate(extents, blocks_per_cluster, 0, &cursor, &first_cluster, &block_offset));
+  TEST_ASSERT_EQUAL(5, first_cluster);
+  TEST_ASSERT_EQUAL(0, block_offset);
+
+  TEST_ASSERT_TRUE(extents_locate(extents, blocks_per_cluster, 7, &cursor, &first_cluster, &block_offset));
+  TEST_ASSERT_EQUAL(5, first_cluster);
+  TEST_ASSERT_EQUAL(7, block_offset);
+
+  TEST_ASSERT_TRUE(extents_locate(extents, blocks_per_cluster, 9, &cursor, &first_cluster, &block_offset));
+  TEST_ASSERT_EQUAL(700, first_cluster);
+  TEST_ASSERT_EQUAL(1, block_offset);
+  TEST_ASSERT_EQUAL(1, cursor.index);
+  TEST_ASSERT_EQUAL(8, cursor.start_block);
+
+  // Seeking backwards rewinds.
+  TEST_ASSERT_TRUE(extents_locate(extents, blocks_per_cluster, 3, &cursor, &first_cluster, &block_offset));
+  TEST_ASSERT_EQUAL(5, first_cluster);
+  TEST_ASSERT_EQUAL(3, block_offset);
+
+  TEST_ASSERT_TRUE(extents_locate(extents, blocks_per_cluster, 19, &cursor, &first_cluster, &block_offset));
+  TEST_ASSERT_EQUAL(700, first_cluster);
+  TEST_ASSERT_EQUAL(11, block_offset);
+
+  // Past the end, and again after that.
+  TEST_ASSERT_FALSE(extents_locate(extents, blocks_per_cluster, 20, &cursor, &first_cluster, &block_offset));
+  TEST_ASSERT_FALSE(extents_locate(extents, blocks_per_cluster, 21, &cursor, &first_cluster, &block_offset));
+  TEST_ASSERT_TRUE(extents_locate(extents, blocks_per_cluster, 1, &cursor, &first_cluster, &block_offset));
+  TEST_ASSERT_EQUAL(1, block_offset);
+}
+
+int main()
+{
+  UNITY_BEGIN();
+  RUN_TEST(test_contiguous);
+  RUN_TEST(test_contiguous_fat32);
+  RUN_TEST(test_fragmented);
+  RUN_TEST(test_broken_chain);
+  RUN_TEST(test_extent_cap);
+  RUN_TEST(test_empty_file);
+  RUN_TEST(test_locate);
+  return UNITY_END();
+}